@@ -1,81 +1,3605 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <cstddef>
-#include <queue>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <limits>
+#include <memory>
+#include <memory_resource>
+#include <mutex>
+#include <new>
+#include <ostream>
+#include <stdexcept>
+#include <thread>
+#include <tuple>
 #include <type_traits>
 #include <utility>
 #include <vector>
 
-class deferred_heap
+#if defined(LAZY_DESTRUCT_STATS)
+#include <array>
+#include <unordered_map>
+#endif
+
+#if defined(__cpp_impl_coroutine) && defined(__cpp_concepts)
+#include <coroutine>
+#define LAZY_DESTRUCT_COROUTINES
+#endif
+
+// LAZY_DESTRUCT_DEBUG records where every entry was deferred, reports entries
+// still pending when a thread's heap is destroyed, and checks that no object
+// is deferred twice. Storage whose object has been deferred is overwritten
+// with a fill pattern, and under AddressSanitizer the free space of segments
+// and pools is poisoned, so use after deferral or after the drain faults.
+// The double-deferral check looks for the fill pattern, so storage handed to
+// defer_range() should not be reused for objects that leave bytes unset.
+#if defined(LAZY_DESTRUCT_DEBUG)
+#include <cstdio>
+#include <cstdlib>
+
+#if defined(__SANITIZE_ADDRESS__)
+#define LAZY_DESTRUCT_ASAN
+#elif defined(__has_feature)
+#if __has_feature(address_sanitizer)
+#define LAZY_DESTRUCT_ASAN
+#endif
+#endif
+
+#if defined(LAZY_DESTRUCT_ASAN)
+#include <sanitizer/asan_interface.h>
+#endif
+
+// Keeps the functions that take a deferral site out of line so that their
+// return address is in the deferring code even in optimized builds.
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#define LAZY_DESTRUCT_SITE __declspec(noinline)
+#define LAZY_DESTRUCT_RETURN_ADDRESS() _ReturnAddress()
+#elif defined(__GNUC__) || defined(__clang__)
+#define LAZY_DESTRUCT_SITE __attribute__((noinline))
+#define LAZY_DESTRUCT_RETURN_ADDRESS() __builtin_return_address(0)
+#else
+#error "LAZY_DESTRUCT_DEBUG needs GCC, Clang or MSVC to find deferral sites"
+#endif
+#else
+#define LAZY_DESTRUCT_SITE
+#endif
+
+// Whether an object can be moved to a new address by copying its bytes and
+// forgetting the original. Specialize as std::true_type for types that are
+// not trivially copyable but still safe to move this way.
+template<typename type>
+struct trivially_relocatable : std::is_trivially_copyable<type> {};
+
+template<typename type, typename deleter>
+struct trivially_relocatable<std::unique_ptr<type, deleter>> : trivially_relocatable<deleter> {};
+
+template<typename type>
+struct trivially_relocatable<std::shared_ptr<type>> : std::true_type {};
+
+template<typename type>
+struct trivially_relocatable<std::weak_ptr<type>> : std::true_type {};
+
+template<typename type>
+inline constexpr bool trivially_relocatable_v = trivially_relocatable<type>::value;
+
+// Whether an object's destructor may run on any thread, letting a parallel
+// deferred_heap::clear() hand it to other cores. Specialize as std::true_type
+// for types whose destructors touch no thread-local or thread-confined state.
+template<typename type>
+struct thread_agnostic : std::false_type {};
+
+template<typename type>
+inline constexpr bool thread_agnostic_v = thread_agnostic<type>::value;
+
+class deferred_reclaimer;
+class epoch_domain;
+
+template<typename type>
+class deferred_handle;
+
+template<typename type>
+class deferred_pool;
+
+#if defined(LAZY_DESTRUCT_COROUTINES)
+// Stands in for the task drain_async() submits, a lambda that captures its
+// state, so that executors taking only function pointers are rejected.
+struct drain_task
+{
+   drain_task() = delete;
+   void operator()() const {}
+
+   void* state;
+};
+
+// A scheduler that drain_async() can hand its next batch to: anything whose
+// execute() accepts a callable and runs it later on the same thread.
+template<typename type>
+concept drain_executor = requires(type& executor, drain_task task)
+{
+   executor.execute(std::move(task));
+};
+
+template<drain_executor executor>
+class drain_awaitable;
+#endif
+
+// Whether lazy_destruct<type> retires into a deferred_pool rather than the
+// heap's shared arena by default. True for small types, for which an entry
+// header would cost as much as the object.
+template<typename type>
+struct pooled : std::bool_constant<sizeof(type) <= 32 && alignof(type) <= alignof(std::max_align_t)> {};
+
+template<typename type>
+inline constexpr bool pooled_v = pooled<type>::value;
+
+enum class destruction_policy
+{
+   // Runs the destructor on the spot, for types that are cheap to destroy.
+   immediate,
+   // Enqueues the object into the thread's deferred_heap.
+   deferred,
+   // Enqueues the object into the thread's deferred_pool for its type.
+   batched,
+   // Posts the object to the running deferred_reclaimer, falling back to
+   // deferred when none runs; meant for expensive destructors.
+   background,
+};
+
+// Chooses how lazy_destruct<type> destroys its object. Specialize to override
+// the default, which follows pooled<type>. Types that cannot be relocated
+// without the risk of throwing are always destroyed immediately.
+template<typename type>
+struct lazy_destruct_policy
+   : std::integral_constant<destruction_policy, pooled_v<type> ? destruction_policy::batched : destruction_policy::deferred> {};
+
+template<typename type>
+inline constexpr destruction_policy lazy_destruct_policy_v = lazy_destruct_policy<type>::value;
+
+enum class destruction_cost
+{
+   normal,
+   // Slow to destroy, e.g. the owner of a large graph. Such elements wait in
+   // a lane of their own that drains after everything else.
+   expensive,
+};
+
+// The cost lazy_destruct<type> assumes unless it is given one explicitly.
+template<typename type>
+struct lazy_destruct_cost : std::integral_constant<destruction_cost, destruction_cost::normal> {};
+
+template<typename type>
+inline constexpr destruction_cost lazy_destruct_cost_v = lazy_destruct_cost<type>::value;
+
+class deferred_heap
+{
+public:
+   struct element_information
+   {
+      element_information(
+         std::size_t size,
+         std::size_t alignment,
+         void (*deleter)(std::byte*, std::size_t) noexcept,
+         void (*relocate)(std::byte*, std::byte*) noexcept = nullptr)
+         :
+         size{ size },
+         alignment{ alignment },
+         deleter{ deleter },
+         relocate{ relocate }
+      {}
+
+      std::size_t size;
+      std::size_t alignment;
+      // Destroys count consecutive elements starting at the given address.
+      void (*deleter)(std::byte*, std::size_t count) noexcept;
+      // Moves the element from source into the uninitialised destination and
+      // ends the source's lifetime. Null if the bytes can simply be copied.
+      void (*relocate)(std::byte* destination, std::byte* source) noexcept;
+      bool thread_agnostic = false;
+      // Index of the type in the heaps' type table; 0 until it is registered,
+      // which of() does once per type.
+      std::uint16_t type = 0;
+#if defined(LAZY_DESTRUCT_DEBUG)
+      // Return address of the code that deferred the element.
+      const void* site = nullptr;
+#endif
+
+      template<typename type>
+      static element_information of()
+      {
+         constexpr auto deleter = [](std::byte * object, std::size_t count) noexcept
+         {
+            std::destroy_n(reinterpret_cast<type*>(object), count);
+         };
+         element_information info{ sizeof(type), alignof(type), deleter };
+         info.thread_agnostic = thread_agnostic_v<type>;
+
+         // Immovable types can only be emplaced, which never relocates them.
+         if constexpr(!trivially_relocatable_v<type> && std::is_move_constructible_v<type>)
+         {
+            info.relocate = [](std::byte * destination, std::byte * source) noexcept
+            {
+               auto* object = reinterpret_cast<type*>(source);
+               new (destination) type(std::move(*object));
+               std::destroy_at(object);
+            };
+         }
+
+         static const auto index = type_table::add(info);
+         info.type = index;
+
+         return info;
+      }
+   };
+
+   enum class capacity_policy
+   {
+      // A single segment of options::capacity bytes.
+      fixed,
+      // Chains new segments, each growth_factor times larger than the last.
+      geometric,
+      // Like geometric, but the segments never total more than max_capacity.
+      bounded,
+   };
+
+   // What enqueue() does with an element that does not fit in the arena.
+   enum class overflow_policy
+   {
+      // Runs the destructor immediately on the calling thread.
+      destroy_inline,
+      // Destroys up to overflow_drain_count of the oldest entries (each a whole
+      // run of same-type elements), then retries once before falling back to
+      // destroy_inline. Elements deferred while the heap drains are spilled.
+      drain_oldest,
+      // Moves the element into an overflow list of separately allocated
+      // segments, each growth_factor times larger than the last.
+      spill,
+      // Passes the full segments to the running deferred_reclaimer and starts
+      // a fresh one; behaves like destroy_inline when no reclaimer runs, and
+      // like spill for elements deferred while the heap drains.
+      hand_off,
+   };
+
+   // What the heap does with pending elements when its thread exits.
+   enum class exit_policy
+   {
+      // Destroys them on the exiting thread.
+      drain,
+      // Passes them to the running deferred_reclaimer, so thread exit does not
+      // wait on destructors; drains when no reclaimer runs.
+      hand_off,
+   };
+
+   struct options
+   {
+      capacity_policy policy = capacity_policy::fixed;
+      std::size_t capacity = 512UL;
+      std::size_t growth_factor = 2UL;
+      std::size_t max_capacity = 0UL;
+
+      overflow_policy overflow = overflow_policy::destroy_inline;
+      std::size_t overflow_drain_count = 8UL;
+
+      // Supplies the segments' storage; null selects the default resource
+      // current when the heap is created. Segments given to the reclaimer are
+      // released on its thread, so with hand-off the resource must be safe to
+      // use from there (e.g. std::pmr::synchronized_pool_resource).
+      std::pmr::memory_resource* resource = nullptr;
+
+      // When set, memory released through defer_free() while one of this heap's
+      // drains runs is collected and passed here in bulk once the drain ends,
+      // one call per group of blocks with the same size and alignment.
+      void (*batch_free)(void** pointers, std::size_t count, std::size_t size, std::size_t alignment) = nullptr;
+
+      exit_policy on_exit = exit_policy::drain;
+
+      // Makes drains that reach the expensive lane pass it to the running
+      // deferred_reclaimer instead of destroying it on this thread.
+      bool hand_off_expensive = false;
+
+      // Lets memory_pressure() and the watermark make the heap relieve()
+      // itself. Clear it for heaps whose elements must not be destroyed
+      // before their owner decides, such as epoch_domain's limbo bags.
+      bool relieve_on_pressure = true;
+   };
+
+   // Number of enqueues that overflowed, by how they were resolved. Elements
+   // that join the overflow list behind an earlier spill do not count.
+   struct overflow_counters
+   {
+      std::size_t destroyed_inline = 0;
+      std::size_t drained = 0;
+      std::size_t spilled = 0;
+      std::size_t handed_off = 0;
+   };
+
+#if defined(LAZY_DESTRUCT_STATS)
+   // What a heap has done since it was created. Elements posted from other
+   // threads count as dequeued but never as enqueued or in use.
+   struct statistics
+   {
+      std::size_t enqueued = 0;
+      std::size_t dequeued = 0;
+      std::size_t overflowed = 0;
+      // Bytes of the objects waiting in the heap and its pools, excluding
+      // entry headers and free space.
+      std::size_t bytes_in_use = 0;
+      std::size_t peak_bytes = 0;
+      // Elements destroyed through each deleter, which identifies their type;
+      // compare keys with element_information::of<type>().deleter.
+      std::unordered_map<void (*)(std::byte*, std::size_t) noexcept, std::size_t> destroyed_by;
+      // Entry i counts the drain calls that took less than 2^(i + 1)
+      // nanoseconds but at least 2^i (or 0 for entry 0).
+      std::array<std::size_t, 64> drain_latency{};
+
+      // Adds the figures of another heap, e.g. to total those of all threads.
+      // Peaks add up too, giving an upper bound on the combined peak.
+      statistics& operator+=(const statistics& other)
+      {
+         enqueued += other.enqueued;
+         dequeued += other.dequeued;
+         overflowed += other.overflowed;
+         bytes_in_use += other.bytes_in_use;
+         peak_bytes += other.peak_bytes;
+
+         for (const auto& [deleter, count] : other.destroyed_by)
+         {
+            destroyed_by[deleter] += count;
+         }
+
+         for (std::size_t bucket = 0; bucket < std::size(drain_latency); ++bucket)
+         {
+            drain_latency[bucket] += other.drain_latency[bucket];
+         }
+
+         return *this;
+      }
+
+      void record_drain(std::chrono::nanoseconds elapsed)
+      {
+         std::size_t bucket = 0;
+         for (auto ticks = static_cast<std::uint64_t>(std::max(elapsed.count(), decltype(elapsed.count()){ 0 })); ticks > 1; ticks >>= 1)
+         {
+            ++bucket;
+         }
+
+         ++drain_latency[bucket];
+      }
+   };
+
+   // Only readable from the heap's own thread; copy it there to aggregate.
+   const statistics& stats() const { return activity; }
+#endif
+
+#if defined(LAZY_DESTRUCT_DEBUG)
+   // Attributes the elements deferred while it is alive to site, normally the
+   // caller of the function creating it, instead of to the heap's own entry
+   // point. Only the outermost one on a thread counts.
+   class debug_site
+   {
+   public:
+      explicit debug_site(const void* site)
+         :
+         outermost{ !current_site() }
+      {
+         if (outermost)
+         {
+            current_site() = site;
+         }
+      }
+
+      debug_site(const debug_site&) = delete;
+      debug_site& operator=(const debug_site&) = delete;
+
+      ~debug_site()
+      {
+         if (outermost)
+         {
+            current_site() = nullptr;
+         }
+      }
+
+   private:
+      const bool outermost;
+   };
+#endif
+
+   // Sets the options used by the calling thread's heap. Must be called before
+   // the thread's first use of get(); returns false (and changes nothing) once
+   // the heap exists.
+   static bool configure(const options& settings)
+   {
+      auto& configuration = thread_configuration();
+      if (configuration.locked)
+      {
+         return false;
+      }
+
+      configuration.settings = settings;
+      return true;
+   }
+
+   // The heap of the innermost deferred_scope open on this thread, or else
+   // the thread's own heap.
+   static deferred_heap& get()
+   {
+      if (auto* scoped = current_scope())
+      {
+         return *scoped;
+      }
+
+      return thread_heap();
+   }
+
+   // The calling thread's own heap, ignoring any deferred_scope.
+   static deferred_heap& thread_heap()
+   {
+      thread_local deferred_heap heap{ lock_configuration(), true };
+      return heap;
+   }
+
+   LAZY_DESTRUCT_SITE void enqueue(element_information info, std::byte* element)
+   {
+      resolve(info);
+#if defined(LAZY_DESTRUCT_DEBUG)
+      check_deferral(info, element, 1, LAZY_DESTRUCT_RETURN_ADDRESS());
+#endif
+      relieve_if_pressed();
+      note_enqueued(info.size);
+
+      // Once anything has spilled, newer elements follow it so that the
+      // overflow list always holds the youngest entries.
+      if (!spilled.empty())
+      {
+         spill(info, element);
+      }
+      else if (!store(info, element))
+      {
+         overflow(info, element);
+      }
+#if defined(LAZY_DESTRUCT_DEBUG)
+      fill_deferred(element, info.size);
+#endif
+   }
+
+   // Enqueues count consecutive elements, starting at elements, in as few
+   // runs as the arena has room for; each run is later destroyed with one
+   // deleter call. Once nothing more fits, elements are enqueued one by one,
+   // which grows the arena or applies the overflow policy as usual.
+   LAZY_DESTRUCT_SITE void enqueue_n(element_information info, std::byte* elements, std::size_t count)
+   {
+      resolve(info);
+#if defined(LAZY_DESTRUCT_DEBUG)
+      check_deferral(info, elements, count, LAZY_DESTRUCT_RETURN_ADDRESS());
+      const debug_site site{ info.site };
+#endif
+      relieve_if_pressed();
+
+      while (count != 0)
+      {
+         std::size_t stored = 0;
+         for (auto batch = count; spilled.empty() && batch != 0 && stored == 0; batch /= 2)
+         {
+            stored = last->push_n(info, elements, batch);
+         }
+
+         if (stored == 0)
+         {
+            enqueue(info, elements);
+            elements += info.size;
+            --count;
+            continue;
+         }
+
+         note_enqueued(stored * info.size, stored);
+#if defined(LAZY_DESTRUCT_DEBUG)
+         fill_deferred(elements, stored * info.size);
+#endif
+         elements += stored * info.size;
+         count -= stored;
+      }
+   }
+
+   // Enqueues an element that is slow to destroy into the expensive lane,
+   // which drains only after every other element, so budgeted drains spend
+   // their slices on cheap ones first. The lane grows as needed, ignoring the
+   // capacity policy.
+   LAZY_DESTRUCT_SITE void enqueue_expensive(element_information info, std::byte* element)
+   {
+      resolve(info);
+#if defined(LAZY_DESTRUCT_DEBUG)
+      check_deferral(info, element, 1, LAZY_DESTRUCT_RETURN_ADDRESS());
+#endif
+      relieve_if_pressed();
+      note_enqueued(info.size);
+
+      if (expensive.empty() || !expensive.last->push(info, element))
+      {
+         auto added = std::make_unique<segment>(std::max(settings.capacity, segment::capacity_for(info)), settings.resource);
+         added->push(info, element);
+         expensive.append(std::move(added));
+      }
+#if defined(LAZY_DESTRUCT_DEBUG)
+      fill_deferred(element, info.size);
+#endif
+   }
+
+   // Constructs an object directly in the heap's storage, so retiring it needs
+   // no copy. The returned handle owns the object; destroying the handle only
+   // marks its slot as dead, and the destructor runs once the heap drains up
+   // to it. A live slot holds back every younger entry, so handles are meant
+   // for objects that die in roughly the order they were created. If the
+   // arena has no room, the object is allocated separately and queued apart
+   // from the arena when the handle dies, without affecting later enqueues.
+   template<typename type, typename... Args>
+   deferred_handle<type> emplace(Args&&... args);
+
+   bool dequeue()
+   {
+      const drain_scope scope{ *this };
+      return release(1, unlimited).elements != 0;
+   }
+
+   void clear()
+   {
+      const drain_scope scope{ *this };
+      while(release(unlimited, unlimited).elements != 0);
+   }
+
+   // Empties the heap using the calling thread and up to helpers tasks run on
+   // workers, anything with execute(task). Elements whose type is marked
+   // thread_agnostic are cut into chunks of chunk_size that all participants
+   // claim from their own share and then steal from the others'; the rest
+   // are destroyed in order on the calling thread. Returns once every chunk is
+   // done, though helpers may still be finishing their tasks. Falls back to
+   // clear() while an object created by emplace() is alive.
+   template<typename executor>
+   void clear(executor& workers, std::size_t helpers, std::size_t chunk_size = 4096UL);
+
+   // Destroys up to count of the oldest elements and returns how many it did.
+   std::size_t drain_n(std::size_t count)
+   {
+      const drain_scope scope{ *this };
+
+      std::size_t drained = 0;
+      while (drained < count)
+      {
+         const auto batch = release(count - drained, unlimited).elements;
+         if (batch == 0)
+         {
+            break;
+         }
+
+         drained += batch;
+      }
+
+      return drained;
+   }
+
+   // Destroys the oldest elements until at least limit bytes of them have been
+   // destroyed or the heap is empty. Returns the number of bytes destroyed.
+   std::size_t drain_bytes(std::size_t limit)
+   {
+      const drain_scope scope{ *this };
+
+      std::size_t drained = 0;
+      while (drained < limit)
+      {
+         const auto batch = release(unlimited, limit - drained).bytes;
+         if (batch == 0)
+         {
+            break;
+         }
+
+         drained += batch;
+      }
+
+      return drained;
+   }
+
+   // Destroys the oldest elements until budget has elapsed or the heap is empty
+   // and returns how many it did. The clock is only read once per batch_size
+   // elements, so the budget can be overrun by up to one batch.
+   std::size_t drain_for(std::chrono::nanoseconds budget, std::size_t batch_size = 16UL)
+   {
+      relieve_if_pressed();
+
+      const drain_scope scope{ *this };
+      const auto deadline = std::chrono::steady_clock::now() + budget;
+      batch_size = std::max(batch_size, std::size_t{ 1 });
+
+      std::size_t drained = 0;
+      do
+      {
+         const auto batch = drain_n(batch_size);
+         drained += batch;
+
+         if (batch < batch_size)
+         {
+            break;
+         }
+      }
+      while (std::chrono::steady_clock::now() < deadline);
+
+      return drained;
+   }
+
+   // Gives every pending element, spilled ones included, to the running
+   // deferred_reclaimer, whose thread then runs the destructors. Elements
+   // posted from other threads stay to be destroyed on this one. Returns
+   // false, leaving the heap untouched, when no reclaimer is running, an
+   // object created by emplace() is still alive or the heap is draining.
+   bool hand_off();
+
+   // Destroys every pending element, as clear() does, and then gives back the
+   // segments the arena grew by, leaving one of options::capacity bytes.
+   void relieve()
+   {
+      relieved = pressure_epoch.load(std::memory_order_relaxed);
+      clear();
+
+      if (first->empty() && !first->next && first->capacity() > settings.capacity)
+      {
+         first = std::make_unique<segment>(settings.capacity, settings.resource);
+         last = first.get();
+         capacity = settings.capacity;
+      }
+
+      freed.shrink_to_fit();
+      freed_pointers.shrink_to_fit();
+   }
+
+   // Asks every heap with options::relieve_on_pressure to relieve() itself;
+   // callable from any thread, e.g. from a cgroup or PSI monitor. Each heap does
+   // so on its own thread, at its next enqueue or drain_for(), so a thread that
+   // never returns to its heap keeps what it holds.
+   static void memory_pressure()
+   {
+      pressure_epoch.fetch_add(1, std::memory_order_relaxed);
+   }
+
+   // Calls memory_pressure() whenever the elements pending in all heaps
+   // together exceed bytes; 0, the default, disables the check. Heaps report
+   // their totals in steps of publish_granule, so the sum seen can lag the
+   // real one by up to that much per thread.
+   static void set_memory_watermark(std::size_t bytes)
+   {
+      watermark.store(bytes, std::memory_order_relaxed);
+   }
+
+   // Bytes of the objects pending in all heaps, as last reported by each.
+   static std::size_t pending_total()
+   {
+      return published_total.load(std::memory_order_relaxed);
+   }
+
+   static constexpr std::size_t publish_granule = 64UL * 1024UL;
+
+   struct thread_pending
+   {
+      std::thread::id thread;
+      std::size_t bytes;
+      std::size_t elements;
+   };
+
+   // What every thread's own heap holds, excluding posted elements, as of its
+   // last enqueue or drain. The heaps keep running while this is read.
+   static std::vector<thread_pending> snapshot()
+   {
+      std::lock_guard lock{ registry_mutex };
+
+      std::vector<thread_pending> threads;
+      threads.reserve(std::size(registry));
+      for (const auto* heap : registry)
+      {
+         threads.push_back({
+            heap->owner,
+            heap->shown_bytes.load(std::memory_order_relaxed),
+            heap->shown_elements.load(std::memory_order_relaxed) });
+      }
+
+      return threads;
+   }
+
+   // One outermost drain call on one heap.
+   struct drain_span
+   {
+      std::thread::id thread;
+      std::chrono::steady_clock::time_point start;
+      std::chrono::nanoseconds duration;
+      std::size_t elements;
+      std::size_t bytes;
+   };
+
+   using drain_tracer = void (*)(const drain_span& span);
+
+   // Has tracer called, on the draining thread, after every outermost drain
+   // of any heap; null, the default, stops tracing. See drain_trace for one
+   // that records Chrome trace events.
+   static void trace_drains(drain_tracer traced)
+   {
+      tracer.store(traced, std::memory_order_relaxed);
+   }
+
+#if defined(LAZY_DESTRUCT_COROUTINES)
+   // Returns an awaitable that drains the heap batch_size elements at a time,
+   // giving each following batch to scheduler.execute() so that other work
+   // runs in between. co_await yields the number of elements destroyed and
+   // resumes the awaiting coroutine from the last batch once the heap is empty
+   // or a batch destroys nothing.
+   template<drain_executor executor>
+   drain_awaitable<executor> drain_async(executor& scheduler, std::size_t batch_size = 64UL);
+#endif
+
+   bool empty() const
+   {
+      if (!first->empty() || first->next || !spilled.empty() || !unplaced.empty() || !expensive.empty() || !posted.empty() || !inbox.empty())
+      {
+         return false;
+      }
+
+      for (auto* pool = pools; pool; pool = pool->next)
+      {
+         if (pool->pending != 0)
+         {
+            return false;
+         }
+      }
+
+      return true;
+   }
+
+   // Enqueues an element into this heap from any thread, typically one other
+   // than the owner, so that its destructor runs on the owning thread during
+   // a later drain there. The element is moved into a segment of its own and
+   // pushed onto a lock-free inbox that the owner takes over in one exchange.
+   // The heap must outlive every post.
+   LAZY_DESTRUCT_SITE void post(element_information info, std::byte* element)
+   {
+      resolve(info);
+#if defined(LAZY_DESTRUCT_DEBUG)
+      check_deferral(info, element, 1, LAZY_DESTRUCT_RETURN_ADDRESS());
+#endif
+      auto posted = std::make_unique<segment>(segment::capacity_for(info), std::pmr::new_delete_resource());
+      posted->push(info, element);
+      inbox.push(std::move(posted));
+#if defined(LAZY_DESTRUCT_DEBUG)
+      fill_deferred(element, info.size);
+#endif
+   }
+
+   template<typename type>
+   void post(type&& value)
+   {
+      using element_type = std::remove_cv_t<std::remove_reference_t<type>>;
+
+      auto info = element_information::of<element_type>();
+#if defined(LAZY_DESTRUCT_DEBUG)
+      info.site = current_site() ? current_site() : LAZY_DESTRUCT_RETURN_ADDRESS();
+#endif
+      auto posted = std::make_unique<segment>(segment::capacity_for(info), std::pmr::new_delete_resource());
+
+      void* entry = nullptr;
+      new (posted->emplace(info, entry)) element_type(std::forward<type>(value));
+      segment::retire(entry);
+
+      inbox.push(std::move(posted));
+   }
+
+   const overflow_counters& overflows() const { return counters; }
+
+   // Hands a block whose object has already been destroyed to the batch of the
+   // drain running on this thread. Returns false, leaving the block to the
+   // caller, when no drain with options::batch_free is running.
+   static bool defer_free(void* pointer, std::size_t size, std::size_t alignment) noexcept
+   {
+      auto* heap = collector();
+      if (!heap)
+      {
+         return false;
+      }
+
+      try
+      {
+         heap->freed.push_back({ size, alignment, pointer });
+      }
+      catch (...)
+      {
+         return false;
+      }
+
+      return true;
+   }
+
+   // Releases blocks obtained from a plain new expression; usable as
+   // options::batch_free.
+   static void sized_free(void** pointers, std::size_t count, std::size_t size, std::size_t alignment)
+   {
+      for (std::size_t index = 0; index < count; ++index)
+      {
+         deallocate(pointers[index], size, alignment);
+      }
+   }
+
+   static void deallocate(void* pointer, std::size_t size, std::size_t alignment) noexcept
+   {
+      if (alignment > __STDCPP_DEFAULT_NEW_ALIGNMENT__)
+      {
+         ::operator delete(pointer, size, std::align_val_t{ alignment });
+      }
+      else
+      {
+         ::operator delete(pointer, size);
+      }
+   }
+
+   ~deferred_heap()
+   {
+      if (per_thread)
+      {
+         exiting() = true;
+      }
+
+#if defined(LAZY_DESTRUCT_DEBUG)
+      if (per_thread)
+      {
+         report_pending();
+      }
+#endif
+
+      if (settings.on_exit != exit_policy::hand_off || !transfer(true))
+      {
+         clear();
+      }
+
+      note_pending(0, 0);
+      publish();
+
+      if (per_thread)
+      {
+         std::lock_guard lock{ registry_mutex };
+         registry.erase(std::find(std::begin(registry), std::end(registry), this));
+      }
+   }
+
+private:
+   friend class deferred_reclaimer;
+   friend class epoch_domain;
+
+   template<typename type>
+   friend class deferred_handle;
+
+   template<typename type>
+   friend class deferred_pool;
+
+   friend class deferred_scope;
+
+   static constexpr auto unlimited = std::numeric_limits<std::size_t>::max();
+
+   struct released
+   {
+      std::size_t elements = 0;
+      std::size_t bytes = 0;
+      void (*deleter)(std::byte*, std::size_t) noexcept = nullptr;
+   };
+
+   // Process-wide table of the element types held in segments, so that entry
+   // headers only store a 16-bit index into it. Entries are added once and
+   // never change; index 0 is reserved to mark where an arena wraps.
+   class type_table
+   {
+   public:
+      struct type_entry
+      {
+         std::size_t size;
+         std::size_t alignment;
+         void (*deleter)(std::byte*, std::size_t) noexcept;
+         bool thread_agnostic;
+      };
+
+      static std::uint16_t add(const element_information& info)
+      {
+         std::lock_guard lock{ mutex };
+         return insert(info);
+      }
+
+      // For descriptions not made by element_information::of(): returns the
+      // index of an equal entry, adding one if there is none.
+      static std::uint16_t find_or_add(const element_information& info)
+      {
+         std::lock_guard lock{ mutex };
+         for (std::size_t index = 1; index < used; ++index)
+         {
+            const auto& entry = at(static_cast<std::uint16_t>(index));
+            if (entry.deleter == info.deleter
+               && entry.size == info.size
+               && entry.alignment == info.alignment
+               && entry.thread_agnostic == info.thread_agnostic)
+            {
+               return static_cast<std::uint16_t>(index);
+            }
+         }
+
+         return insert(info);
+      }
+
+      static const type_entry& at(std::uint16_t index)
+      {
+         return blocks[index / block_size].load(std::memory_order_acquire)->entries[index % block_size];
+      }
+
+   private:
+      static constexpr std::size_t block_size = 256UL;
+
+      struct block
+      {
+         type_entry entries[block_size];
+      };
+
+      static std::uint16_t insert(const element_information& info)
+      {
+         if (used > std::numeric_limits<std::uint16_t>::max())
+         {
+            throw std::length_error{ "deferred_heap: too many element types" };
+         }
+
+         auto& slot = blocks[used / block_size];
+         auto* current = slot.load(std::memory_order_relaxed);
+         if (!current)
+         {
+            current = new block{};
+         }
+
+         current->entries[used % block_size] = { info.size, info.alignment, info.deleter, info.thread_agnostic };
+         slot.store(current, std::memory_order_release);
+
+         return static_cast<std::uint16_t>(used++);
+      }
+
+      static inline std::mutex mutex;
+      static inline std::atomic<block*> blocks[(std::size_t{ std::numeric_limits<std::uint16_t>::max() } + 1) / block_size]{};
+      static inline std::size_t used = 1;
+   };
+
+   static void resolve(element_information& info)
+   {
+      if (info.type == 0)
+      {
+         info.type = type_table::find_or_add(info);
+      }
+   }
+
+   // Consecutive elements of one type, destroyed by a single deleter call.
+   struct run
+   {
+      void (*deleter)(std::byte*, std::size_t) noexcept;
+      std::byte* objects;
+      std::size_t count;
+      std::size_t size;
+      bool thread_agnostic;
+#if defined(LAZY_DESTRUCT_DEBUG)
+      const void* site = nullptr;
+#endif
+   };
+
+   // A circular byte arena in which every run of consecutive same-type
+   // elements is preceded by an entry_header, so pushes and pops only move the
+   // tail and head cursors.
+   class segment
+   {
+   public:
+      segment(std::size_t capacity, std::pmr::memory_resource* resource)
+         :
+         resource{ resource },
+         size{ capacity + (alignof(entry_header) - capacity % alignof(entry_header)) % alignof(entry_header) },
+         storage{ static_cast<std::byte*>(resource->allocate(size, alignof(std::max_align_t))) }
+      {
+#if defined(LAZY_DESTRUCT_DEBUG)
+         poison(storage, size);
+#endif
+      }
+
+      segment(const segment&) = delete;
+      segment& operator=(const segment&) = delete;
+
+      ~segment()
+      {
+#if defined(LAZY_DESTRUCT_DEBUG)
+         unpoison(storage, size);
+#endif
+         resource->deallocate(storage, size, alignof(std::max_align_t));
+      }
+
+      bool push(const element_information& info, std::byte* element)
+      {
+         auto* slot = append(info);
+         if (!slot)
+         {
+            const auto offset = reserve(info);
+            if (offset == npos)
+            {
+               return false;
+            }
+
+            slot = object_at(offset);
+         }
+
+         deferred_heap::relocate(info, slot, element);
+         return true;
+      }
+
+      // Relocates up to count consecutive elements into one new run and
+      // returns how many it took; none if they do not fit together.
+      std::size_t push_n(const element_information& info, std::byte* elements, std::size_t count)
+      {
+         count = std::min(count, longest_run);
+
+         const auto offset = reserve(info, count);
+         if (offset == npos)
+         {
+            return 0;
+         }
+
+         auto* slot = object_at(offset);
+         if (info.relocate)
+         {
+            for (std::size_t index = 0; index < count; ++index)
+            {
+               info.relocate(slot + index * info.size, elements + index * info.size);
+            }
+         }
+         else
+         {
+            std::memcpy(slot, elements, count * info.size);
+         }
+
+         return count;
+      }
+
+      // Reserves a slot for an element that is constructed in place and is
+      // still alive. Its run has a count of zero, which stops pop() and
+      // append(), until retire() is called with the returned entry.
+      std::byte* emplace(const element_information& info, void*& entry)
+      {
+         const auto offset = reserve(info);
+         if (offset == npos)
+         {
+            return nullptr;
+         }
+
+         header_at(offset).count = 0;
+         entry = &header_at(offset);
+         return object_at(offset);
+      }
+
+      // Capacity of a segment that can always hold count elements described by info.
+      static std::size_t capacity_for(const element_information& info, std::size_t count = 1UL)
+      {
+         const auto runs = (count + longest_run - 1) / longest_run;
+
+         return runs * (sizeof(entry_header) + info.alignment + alignof(entry_header)) + count * info.size;
+      }
+
+      static void retire(void* entry)
+      {
+         static_cast<entry_header*>(entry)->count = 1;
+      }
+
+      // Retires an entry whose element was never constructed.
+      static void abandon(void* entry)
+      {
+         static_cast<entry_header*>(entry)->count = abandoned | 1;
+      }
+
+      // Destroys up to limit elements of the oldest run, stopping early once
+      // bytes have been destroyed, with a single call to its deleter.
+      released pop(std::size_t limit, std::size_t bytes)
+      {
+         if (entries == 0 || header_at(head).count == 0)
+         {
+            return {};
+         }
+
+         auto& header = header_at(head);
+         const auto& type = type_table::at(header.type);
+         const bool skipped = (header.count & abandoned) != 0;
+         const std::size_t length = run_length(header);
+         const auto size = type.size;
+         const std::size_t count = std::min({
+            limit,
+            length - destroyed,
+            bytes / size + (bytes % size != 0) });
+
+         if (!skipped)
+         {
+            type.deleter(object_at(head) + destroyed * size, count);
+         }
+#if defined(LAZY_DESTRUCT_DEBUG)
+         poison(object_at(head) + destroyed * size, count * size);
+#endif
+
+         // The deleter may have appended to this run, so its length is read
+         // again.
+         destroyed += count;
+         if (destroyed == run_length(header))
+         {
+            destroyed = 0;
+            head = end_of(head);
+
+            if (--entries == 0)
+            {
+               head = tail = 0;
+               last = npos;
+            }
+            else if (wraps_at(head))
+            {
+               head = 0;
+            }
+         }
+
+         return { count, count * size, skipped ? nullptr : type.deleter };
+      }
+
+      // Passes every run, oldest first, to visit without destroying anything.
+      // A partly drained run is passed without its destroyed elements, and
+      // abandoned entries are left out.
+      template<typename visitor>
+      void for_each_run(visitor&& visit)
+      {
+         auto offset = head;
+         std::size_t gone = destroyed;
+
+         for (std::size_t entry = 0; entry != entries; ++entry)
+         {
+            const auto& header = header_at(offset);
+            if ((header.count & abandoned) == 0)
+            {
+               const auto& type = type_table::at(header.type);
+               run pending{ type.deleter, object_at(offset) + gone * type.size, run_length(header) - gone, type.size, type.thread_agnostic };
+#if defined(LAZY_DESTRUCT_DEBUG)
+               pending.site = header.site;
+#endif
+               visit(pending);
+            }
+
+            gone = 0;
+            offset = end_of(offset);
+            if (entry + 1 != entries && wraps_at(offset))
+            {
+               offset = 0;
+            }
+         }
+      }
+
+      bool empty() const { return entries == 0; }
+      std::size_t capacity() const { return size; }
+
+      std::unique_ptr<segment> next;
+      // Links chains of segments inside a segment_stack.
+      segment* pending = nullptr;
+
+   private:
+      // In-arena bookkeeping for a run of count elements of one type, whose
+      // size, alignment and deleter come from the type table. The first element
+      // follows the header at the type's alignment. Type 0 marks the point
+      // where the arena wraps around.
+      struct entry_header
+      {
+         std::uint16_t type;
+         std::uint16_t count;
+#if defined(LAZY_DESTRUCT_DEBUG)
+         const void* site = nullptr;
+#endif
+      };
+
+      // Set in the count of an entry whose element was never constructed.
+      static constexpr std::uint16_t abandoned = 0x8000;
+      static constexpr std::size_t longest_run = abandoned - 1;
+
+      static constexpr auto npos = static_cast<std::size_t>(-1);
+
+      static std::size_t run_length(const entry_header& header)
+      {
+         return header.count & ~abandoned;
+      }
+
+      entry_header& header_at(std::size_t offset)
+      {
+         return *std::launder(reinterpret_cast<entry_header*>(storage + offset));
+      }
+
+      std::size_t object_offset(std::size_t offset)
+      {
+         return align(offset + sizeof(entry_header), type_table::at(header_at(offset).type).alignment);
+      }
+
+      std::byte* object_at(std::size_t offset)
+      {
+         return storage + object_offset(offset);
+      }
+
+      // Offset just past the last element of the run at offset.
+      std::size_t objects_end(std::size_t offset)
+      {
+         const auto& header = header_at(offset);
+         return object_offset(offset) + type_table::at(header.type).size * run_length(header);
+      }
+
+      // Offset of the header following the one at offset.
+      std::size_t end_of(std::size_t offset)
+      {
+         return align(objects_end(offset), alignof(entry_header));
+      }
+
+      // Extends the newest run by one element if info has the same type and the
+      // space right behind the run is free; returns the new element's slot.
+      std::byte* append(const element_information& info)
+      {
+         if (last == npos)
+         {
+            return nullptr;
+         }
+
+         auto& header = header_at(last);
+         if (header.type != info.type
+            || header.count == 0
+            || header.count >= longest_run)
+         {
+            return nullptr;
+         }
+#if defined(LAZY_DESTRUCT_DEBUG)
+         if (header.site != info.site)
+         {
+            return nullptr;
+         }
+#endif
+
+         const auto end = tail <= head ? head : size;
+         const auto slot = objects_end(last);
+         if (info.size > end - slot)
+         {
+            return nullptr;
+         }
+
+#if defined(LAZY_DESTRUCT_DEBUG)
+         unpoison(storage + slot, info.size);
+#endif
+         ++header.count;
+         tail = end_of(last);
+         return storage + slot;
+      }
+
+      bool wraps_at(std::size_t offset)
+      {
+         return size - offset < sizeof(entry_header) || header_at(offset).type == 0;
+      }
+
+      // Places a header and room for count elements in the circular arena and
+      // returns the header's offset, or npos if there is no room. The live
+      // region runs from head to tail and may wrap past the end of the buffer;
+      // head == tail is ambiguous, so emptiness is taken from count. The object
+      // is padded so that its address, not just its offset, is a multiple of
+      // info.alignment.
+      std::size_t reserve(const element_information& info, std::size_t count = 1UL)
+      {
+         const auto object_at = [&](std::size_t offset)
+         {
+            return align(offset + sizeof(entry_header), info.alignment);
+         };
+         const auto fits = [&](std::size_t offset, std::size_t end)
+         {
+            const auto object = object_at(offset);
+            return object <= end && info.size * count <= end - object;
+         };
+
+         const bool wrapped = entries != 0 && tail <= head;
+         std::size_t offset;
+
+         if (!wrapped && fits(tail, size))
+         {
+            offset = tail;
+         }
+         else if (!wrapped && fits(0, head))
+         {
+            if (size - tail >= sizeof(entry_header))
+            {
+#if defined(LAZY_DESTRUCT_DEBUG)
+               unpoison(storage + tail, sizeof(entry_header));
+#endif
+               new (storage + tail) entry_header{ 0, 0 };
+            }
+            offset = 0;
+         }
+         else if (wrapped && fits(tail, head))
+         {
+            offset = tail;
+         }
+         else
+         {
+            return npos;
+         }
+
+#if defined(LAZY_DESTRUCT_DEBUG)
+         unpoison(storage + offset, object_at(offset) + info.size * count - offset);
+         new (storage + offset) entry_header{ info.type, static_cast<std::uint16_t>(count), info.site };
+#else
+         new (storage + offset) entry_header{ info.type, static_cast<std::uint16_t>(count) };
+#endif
+
+         tail = end_of(offset);
+         last = offset;
+         ++entries;
+         return offset;
+      }
+
+      std::size_t align(std::size_t offset, std::size_t alignment) const
+      {
+         const auto base = reinterpret_cast<std::uintptr_t>(storage);
+         const auto address = base + offset;
+         return offset + (alignment - address % alignment) % alignment;
+      }
+
+      std::pmr::memory_resource* resource;
+      std::size_t size;
+      std::byte* storage;
+      std::size_t head = 0;
+      std::size_t tail = 0;
+      std::size_t last = npos;
+      // Number of runs, and how many elements of the head run are destroyed.
+      std::size_t entries = 0;
+      std::size_t destroyed = 0;
+   };
+
+   // Lock-free stack of segment chains: any number of threads may push, and a
+   // consumer takes everything pushed so far with a single exchange.
+   class segment_stack
+   {
+   public:
+      void push(std::unique_ptr<segment> chain)
+      {
+         auto* node = chain.release();
+         node->pending = top.load(std::memory_order_relaxed);
+
+         while (!top.compare_exchange_weak(node->pending, node, std::memory_order_release, std::memory_order_relaxed));
+      }
+
+      // Returns the chains in the order they were pushed.
+      std::vector<std::unique_ptr<segment>> take()
+      {
+         std::vector<std::unique_ptr<segment>> chains;
+
+         for (auto* node = top.exchange(nullptr, std::memory_order_acquire); node; )
+         {
+            auto* pending = std::exchange(node->pending, nullptr);
+            chains.emplace_back(node);
+            node = pending;
+         }
+
+         std::reverse(std::begin(chains), std::end(chains));
+         return chains;
+      }
+
+      bool empty() const { return top.load(std::memory_order_relaxed) == nullptr; }
+
+      ~segment_stack()
+      {
+         take();
+      }
+
+   private:
+      std::atomic<segment*> top{ nullptr };
+   };
+
+   struct freed_block
+   {
+      std::size_t size;
+      std::size_t alignment;
+      void* pointer;
+   };
+
+   static deferred_heap*& current_scope()
+   {
+      thread_local deferred_heap* current = nullptr;
+      return current;
+   }
+
+   static deferred_heap*& collector()
+   {
+      thread_local deferred_heap* current = nullptr;
+      return current;
+   }
+
+   // Set once the thread's own heap is being destroyed.
+   static bool& exiting()
+   {
+      thread_local bool current = false;
+      return current;
+   }
+
+   // Brackets the outermost drain call on a heap. With options::batch_free
+   // the heap collects defer_free() blocks meanwhile and releases them group
+   // by group at the end; with LAZY_DESTRUCT_STATS or a drain tracer the call
+   // is timed.
+   class drain_scope
+   {
+   public:
+      explicit drain_scope(deferred_heap& heap)
+         :
+         heap{ heap },
+         outermost{ !heap.draining },
+         collecting{ outermost && heap.settings.batch_free && !collector() },
+         traced{ outermost ? tracer.load(std::memory_order_relaxed) : nullptr }
+      {
+         if (traced)
+         {
+            span = { std::this_thread::get_id(), std::chrono::steady_clock::now(), {}, heap.released_elements, heap.released_bytes };
+         }
+
+         heap.draining = true;
+         if (collecting)
+         {
+            collector() = &heap;
+         }
+      }
+
+      drain_scope(const drain_scope&) = delete;
+      drain_scope& operator=(const drain_scope&) = delete;
+
+      ~drain_scope()
+      {
+         if (collecting)
+         {
+            collector() = nullptr;
+            heap.flush_freed();
+         }
+
+         if (outermost)
+         {
+            heap.draining = false;
+#if defined(LAZY_DESTRUCT_STATS)
+            heap.activity.record_drain(std::chrono::steady_clock::now() - start);
+#endif
+         }
+
+         if (traced)
+         {
+            span.duration = std::chrono::steady_clock::now() - span.start;
+            span.elements = heap.released_elements - span.elements;
+            span.bytes = heap.released_bytes - span.bytes;
+            traced(span);
+         }
+      }
+
+   private:
+      deferred_heap& heap;
+      const bool outermost;
+      const bool collecting;
+      const drain_tracer traced;
+      drain_span span{};
+#if defined(LAZY_DESTRUCT_STATS)
+      const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+#endif
+   };
+
+   void flush_freed()
+   {
+      const auto by_class = [](const freed_block& lhs, const freed_block& rhs)
+      {
+         return std::tie(lhs.size, lhs.alignment) < std::tie(rhs.size, rhs.alignment);
+      };
+      std::sort(std::begin(freed), std::end(freed), by_class);
+
+      for (auto first_block = std::begin(freed); first_block != std::end(freed); )
+      {
+         const auto last_block = std::upper_bound(first_block, std::end(freed), *first_block, by_class);
+
+         freed_pointers.clear();
+         std::transform(first_block, last_block, std::back_inserter(freed_pointers), [](const freed_block& block) { return block.pointer; });
+         settings.batch_free(freed_pointers.data(), std::size(freed_pointers), first_block->size, first_block->alignment);
+
+         first_block = last_block;
+      }
+
+      freed.clear();
+   }
+
+   // Segments that are drained front to back and released once empty.
+   struct segment_chain
+   {
+      void append(std::unique_ptr<segment> added)
+      {
+         auto* tail = added.get();
+         (first ? last->next : first) = std::move(added);
+         last = tail;
+      }
+
+      released pop(std::size_t limit, std::size_t bytes)
+      {
+         while (first)
+         {
+            const auto batch = first->pop(limit, bytes);
+            if (!first->empty())
+            {
+               return batch;
+            }
+
+            first = std::move(first->next);
+            if (batch.elements != 0)
+            {
+               return batch;
+            }
+         }
+
+         return {};
+      }
+
+      bool empty() const { return !first; }
+
+      std::unique_ptr<segment> first;
+      segment* last = nullptr;
+   };
+
+   // Chunks of thread-agnostic runs shared out among the participants of a
+   // parallel clear(). Kept alive by every helper task, since a helper that
+   // starts after the work is done still looks at the shares.
+   struct parallel_drain
+   {
+      struct share
+      {
+         std::atomic<std::size_t> next;
+         std::size_t end;
+      };
+
+      explicit parallel_drain(std::vector<run> work, std::size_t participants)
+         :
+         chunks{ std::move(work) },
+         shares{ std::make_unique<share[]>(participants) },
+         participants{ participants }
+      {
+         for (std::size_t index = 0; index < participants; ++index)
+         {
+            shares[index].next.store(std::size(chunks) * index / participants, std::memory_order_relaxed);
+            shares[index].end = std::size(chunks) * (index + 1) / participants;
+         }
+      }
+
+      void work(std::size_t self)
+      {
+         for (std::size_t offset = 0; offset < participants; ++offset)
+         {
+            auto& victim = shares[(self + offset) % participants];
+            for (auto index = victim.next.fetch_add(1, std::memory_order_relaxed); index < victim.end; index = victim.next.fetch_add(1, std::memory_order_relaxed))
+            {
+               chunks[index].deleter(chunks[index].objects, chunks[index].count);
+
+               if (completed.fetch_add(1, std::memory_order_acq_rel) + 1 == std::size(chunks))
+               {
+                  std::lock_guard lock{ mutex };
+                  finished.notify_all();
+               }
+            }
+         }
+      }
+
+      void wait()
+      {
+         std::unique_lock lock{ mutex };
+         finished.wait(lock, [this] { return completed.load(std::memory_order_acquire) == std::size(chunks); });
+      }
+
+      const std::vector<run> chunks;
+      const std::unique_ptr<share[]> shares;
+      const std::size_t participants;
+
+      std::atomic<std::size_t> completed{ 0 };
+      std::mutex mutex;
+      std::condition_variable finished;
+   };
+
+   // A deferred_pool attached to the heap, whose drains visit it after the
+   // arena. release destroys elements like segment::pop(); flush moves them all
+   // into a new segment.
+   struct pool_link
+   {
+      released (*release)(pool_link& pool, std::size_t limit, std::size_t bytes);
+      std::unique_ptr<segment> (*flush)(pool_link& pool);
+      std::size_t pending = 0;
+      pool_link* next = nullptr;
+   };
+
+   void attach(pool_link& pool)
+   {
+      pool.next = pools;
+      pools = &pool;
+   }
+
+   void detach(pool_link& pool)
+   {
+      auto** link = &pools;
+      while (*link != &pool)
+      {
+         link = &(*link)->next;
+      }
+
+      *link = pool.next;
+   }
+
+   struct configuration
+   {
+      options settings;
+      bool locked = false;
+   };
+
+   static configuration& thread_configuration()
+   {
+      thread_local configuration current;
+      return current;
+   }
+
+   static options with_resource(options settings)
+   {
+      if (!settings.resource)
+      {
+         settings.resource = std::pmr::get_default_resource();
+      }
+
+      return settings;
+   }
+
+   static const options& lock_configuration()
+   {
+      auto& configuration = thread_configuration();
+      configuration.locked = true;
+      return configuration.settings;
+   }
+
+   explicit deferred_heap(const options& configured, bool per_thread = false)
+      :
+      settings{ with_resource(configured) },
+      first{ std::make_unique<segment>(settings.capacity, settings.resource) },
+      last{ first.get() },
+      capacity{ settings.capacity },
+      per_thread{ per_thread }
+   {
+      if (per_thread)
+      {
+         std::lock_guard lock{ registry_mutex };
+         registry.push_back(this);
+      }
+   }
+
+   // Appends a segment that can hold info, or returns false if the policy
+   // forbids it. Older segments stay in the chain until they drain so that
+   // destruction order is preserved.
+   bool grow(const element_information& info)
+   {
+      if (settings.policy == capacity_policy::fixed)
+      {
+         return false;
+      }
+
+      const auto required = segment::capacity_for(info);
+      auto size = std::max(last->capacity() * settings.growth_factor, required);
+
+      if (settings.policy == capacity_policy::bounded)
+      {
+         if (capacity >= settings.max_capacity || settings.max_capacity - capacity < required)
+         {
+            return false;
+         }
+
+         size = std::min(size, settings.max_capacity - capacity);
+      }
+
+      last->next = std::make_unique<segment>(size, settings.resource);
+      last = last->next.get();
+      capacity += size;
+      return true;
+   }
+
+   // Destroys up to limit of the oldest elements of a single run, stopping
+   // early once bytes have been destroyed. Returns nothing if the heap is empty.
+   released release(std::size_t limit, std::size_t bytes)
+   {
+      if (const auto batch = release_posted(limit, bytes); batch.elements != 0)
+      {
+         note_released(batch, false);
+         return batch;
+      }
+
+      const auto batch = release_local(limit, bytes);
+      note_released(batch, true);
+      return batch;
+   }
+
+   released release_local(std::size_t limit, std::size_t bytes)
+   {
+      while (first->empty() && first->next)
+      {
+         capacity -= first->capacity();
+         first = std::move(first->next);
+      }
+
+      // A live emplaced object at the head blocks everything behind it,
+      // including the younger spilled elements, but not the pools.
+      if (!first->empty())
+      {
+         if (const auto batch = first->pop(limit, bytes); batch.elements != 0)
+         {
+            return batch;
+         }
+
+         return release_pooled(limit, bytes);
+      }
+
+      if (const auto batch = release_pooled(limit, bytes); batch.elements != 0)
+      {
+         return batch;
+      }
+
+      if (const auto batch = spilled.pop(limit, bytes); batch.elements != 0)
+      {
+         return batch;
+      }
+
+      if (const auto batch = unplaced.pop(limit, bytes); batch.elements != 0)
+      {
+         return batch;
+      }
+
+      return release_expensive(limit, bytes);
+   }
+
+   released release_expensive(std::size_t limit, std::size_t bytes);
+
+   released release_pooled(std::size_t limit, std::size_t bytes)
+   {
+      for (auto* pool = pools; pool; pool = pool->next)
+      {
+         if (pool->pending != 0)
+         {
+            return pool->release(*pool, limit, bytes);
+         }
+      }
+
+      return {};
+   }
+
+   // Destroys elements posted from other threads, which have no order
+   // relative to the heap's own entries.
+   released release_posted(std::size_t limit, std::size_t bytes)
+   {
+      if (!inbox.empty())
+      {
+         for (auto& segment : inbox.take())
+         {
+            posted.append(std::move(segment));
+         }
+      }
+
+      return posted.pop(limit, bytes);
+   }
+
+   bool store(element_information& info, std::byte* element)
+   {
+      return last->push(info, element) || (grow(info) && last->push(info, element));
+   }
+
+   void overflow(element_information& info, std::byte* element)
+   {
+      note_overflow();
+
+      switch (settings.overflow)
+      {
+      case overflow_policy::drain_oldest:
+         // A drain is already destroying the oldest run, which a nested
+         // release() would destroy again, so spill instead.
+         if (draining)
+         {
+            spill(info, element);
+            ++counters.spilled;
+            return;
+         }
+
+         {
+            const drain_scope scope{ *this };
+            for (auto count = settings.overflow_drain_count; count != 0 && release(unlimited, unlimited).elements != 0; --count);
+         }
+
+         if (store(info, element))
+         {
+            ++counters.drained;
+            return;
+         }
+         break;
+
+      case overflow_policy::spill:
+         spill(info, element);
+         ++counters.spilled;
+         return;
+
+      case overflow_policy::hand_off:
+         // A destructor run by a drain must not hand off the segment being
+         // drained, so what it defers is spilled instead.
+         if (draining)
+         {
+            spill(info, element);
+            ++counters.spilled;
+            return;
+         }
+
+         if (hand_off() && store(info, element))
+         {
+            ++counters.handed_off;
+            return;
+         }
+         break;
+
+      case overflow_policy::destroy_inline:
+         break;
+      }
+
+      ++counters.destroyed_inline;
+      info.deleter(element, 1);
+      note_released({ 1, info.size, info.deleter }, true);
+   }
+
+   // Appends to the newest overflow segment while it has room, and otherwise
+   // chains a larger one, so a heap that keeps spilling reuses its storage.
+   void spill(const element_information& info, std::byte* element)
+   {
+      if (!spilled.empty() && spilled.last->push(info, element))
+      {
+         return;
+      }
+
+      const auto size = spilled.empty() ? settings.capacity : spilled.last->capacity() * settings.growth_factor;
+      auto storage = std::make_unique<segment>(std::max(size, segment::capacity_for(info)), settings.resource);
+      storage->push(info, element);
+      spilled.append(std::move(storage));
+   }
+
+   // Pushes everything pending to the reclaimer, leaving the heap without a
+   // segment; returns false without changes when that is not possible. Posted
+   // elements are only included once the owning thread is exiting.
+   bool transfer(bool exiting);
+
+   static void relocate(const element_information& info, std::byte* destination, std::byte* source)
+   {
+      if (info.relocate)
+      {
+         info.relocate(destination, source);
+      }
+      else
+      {
+         std::memcpy(destination, source, info.size);
+      }
+   }
+
+   options settings;
+   std::unique_ptr<segment> first;
+   segment* last;
+   std::size_t capacity;
+
+   segment_chain spilled;
+   // Objects emplace() allocated separately, once their handles die.
+   segment_chain unplaced;
+   segment_chain expensive;
+
+   segment_stack inbox;
+   segment_chain posted;
+
+   overflow_counters counters;
+
+   pool_link* pools = nullptr;
+
+   // Set while a drain_scope is open.
+   bool draining = false;
+
+   void note_enqueued(std::size_t bytes, std::size_t elements = 1UL)
+   {
+      note_pending(pending_bytes + bytes, pending_elements + elements);
+#if defined(LAZY_DESTRUCT_STATS)
+      activity.enqueued += elements;
+#endif
+   }
+
+   void note_overflow()
+   {
+#if defined(LAZY_DESTRUCT_STATS)
+      ++activity.overflowed;
+#endif
+   }
+
+   // local is false for elements posted from other threads.
+   void note_released(const released& batch, bool local)
+   {
+      if (batch.elements == 0)
+      {
+         return;
+      }
+
+      released_elements += batch.elements;
+      released_bytes += batch.bytes;
+      if (local)
+      {
+         note_pending(pending_bytes - std::min(batch.bytes, pending_bytes), pending_elements - std::min(batch.elements, pending_elements));
+      }
+#if defined(LAZY_DESTRUCT_STATS)
+      activity.dequeued += batch.elements;
+      if (batch.deleter)
+      {
+         activity.destroyed_by[batch.deleter] += batch.elements;
+      }
+#endif
+   }
+
+   // Pending bytes are published to the process-wide total only once they
+   // have moved by publish_granule, or the heap has emptied, which keeps
+   // enqueues off the shared cache line.
+   void note_pending(std::size_t bytes, std::size_t elements)
+   {
+      pending_bytes = bytes;
+      pending_elements = elements;
+      shown_bytes.store(bytes, std::memory_order_relaxed);
+      shown_elements.store(elements, std::memory_order_relaxed);
+#if defined(LAZY_DESTRUCT_STATS)
+      activity.bytes_in_use = bytes;
+      activity.peak_bytes = std::max(activity.peak_bytes, bytes);
+#endif
+
+      if (std::max(bytes, published_bytes) - std::min(bytes, published_bytes) >= publish_granule
+         || (bytes == 0 && published_bytes != 0))
+      {
+         publish();
+      }
+   }
+
+   void publish()
+   {
+      const auto change = pending_bytes - published_bytes;
+      const auto total = published_total.fetch_add(change, std::memory_order_relaxed) + change;
+      published_bytes = pending_bytes;
+
+      if (const auto limit = watermark.load(std::memory_order_relaxed); limit != 0 && total > limit)
+      {
+         memory_pressure();
+      }
+   }
+
+   void relieve_if_pressed()
+   {
+      if (settings.relieve_on_pressure && relieved != pressure_epoch.load(std::memory_order_relaxed) && !draining)
+      {
+         relieve();
+      }
+   }
+
+   // Bytes and number of the objects pending in this heap and its pools,
+   // excluding posted ones; the part of the bytes included in published_total;
+   // and the copies of both figures that snapshot() reads from other threads.
+   std::size_t pending_bytes = 0;
+   std::size_t pending_elements = 0;
+   std::size_t published_bytes = 0;
+   std::atomic<std::size_t> shown_bytes{ 0 };
+   std::atomic<std::size_t> shown_elements{ 0 };
+
+   // Everything this heap has destroyed, posted elements included, which
+   // drain_scope reads to describe its span.
+   std::size_t released_elements = 0;
+   std::size_t released_bytes = 0;
+   // Value of pressure_epoch when the heap last relieved itself.
+   std::uint64_t relieved = pressure_epoch.load(std::memory_order_relaxed);
+
+   static inline std::atomic<std::size_t> watermark{ 0 };
+   static inline std::atomic<std::size_t> published_total{ 0 };
+   static inline std::atomic<std::uint64_t> pressure_epoch{ 0 };
+
+#if defined(LAZY_DESTRUCT_STATS)
+   statistics activity;
+#endif
+
+   void retire(void* entry);
+
+   std::vector<freed_block> freed;
+   std::vector<void*> freed_pointers;
+
+   // Objects created by emplace() whose handles are still alive in the arena.
+   std::size_t pinned = 0;
+
+   // Set for the heap thread_heap() creates, which is listed in registry.
+   const bool per_thread;
+   const std::thread::id owner = std::this_thread::get_id();
+
+   static inline std::mutex registry_mutex;
+   static inline std::vector<deferred_heap*> registry;
+
+   static inline std::atomic<drain_tracer> tracer{ nullptr };
+
+#if defined(LAZY_DESTRUCT_DEBUG)
+   static constexpr auto deferred_fill = std::byte{ 0xdb };
+
+   static const void*& current_site()
+   {
+      thread_local const void* site = nullptr;
+      return site;
+   }
+
+   static void describe(const void* site)
+   {
+#if defined(LAZY_DESTRUCT_ASAN)
+      char symbol[512];
+      __sanitizer_symbolize_pc(const_cast<char*>(static_cast<const char*>(site)) - 1, "%p %F %L", symbol, sizeof(symbol));
+      std::fprintf(stderr, "    %s\n", symbol);
+#else
+      std::fprintf(stderr, "    %p\n", site);
+#endif
+   }
+
+   // Records where the count elements at elements are deferred from, and stops
+   // the program if one of them holds nothing but the fill pattern, i.e. was
+   // already deferred.
+   static void check_deferral(element_information& info, const std::byte* elements, std::size_t count, const void* caller)
+   {
+      if (!info.site)
+      {
+         info.site = current_site() ? current_site() : caller;
+      }
+
+      for (std::size_t index = 0; index < count; ++index)
+      {
+         const auto* element = elements + index * info.size;
+         if (std::all_of(element, element + info.size, [](std::byte value) { return value == deferred_fill; }))
+         {
+            std::fprintf(stderr, "lazy_destruct: object at %p deferred twice, the second time at\n", static_cast<const void*>(element));
+            describe(info.site);
+#if defined(LAZY_DESTRUCT_ASAN)
+            __sanitizer_print_stack_trace();
+#endif
+            std::abort();
+         }
+      }
+   }
+
+   static void fill_deferred(std::byte* elements, std::size_t bytes)
+   {
+      std::memset(elements, static_cast<int>(deferred_fill), bytes);
+   }
+
+   // Numbers of pending elements by deferral site.
+   using site_counts = std::vector<std::pair<const void*, std::size_t>>;
+
+   static void count_site(site_counts& sites, const void* site, std::size_t count)
+   {
+      const auto found = std::find_if(std::begin(sites), std::end(sites), [&](const auto& entry) { return entry.first == site; });
+      (found != std::end(sites) ? found->second : sites.emplace_back(site, 0).second) += count;
+   }
+
+   static void print_pending(const site_counts& sites)
+   {
+      std::size_t total = 0;
+      for (const auto& entry : sites)
+      {
+         total += entry.second;
+      }
+
+      if (total == 0)
+      {
+         return;
+      }
+
+      std::fprintf(stderr, "lazy_destruct: %zu elements still pending at thread exit\n", total);
+      for (const auto& [site, entries] : sites)
+      {
+         std::fprintf(stderr, "  %zu deferred at\n", entries);
+         describe(site);
+      }
+   }
+
+   // Lists, by deferral site, the elements still waiting when the heap is
+   // destroyed; they are drained or handed off right after. The thread's pools
+   // are gone by then, having reported the elements they drained themselves
+   // and flushed the rest into the heap.
+   void report_pending()
+   {
+      release_posted(0, 0);
+
+      site_counts sites;
+      for (auto* chain : { first.get(), spilled.first.get(), unplaced.first.get(), expensive.first.get(), posted.first.get() })
+      {
+         for (; chain; chain = chain->next.get())
+         {
+            chain->for_each_run([&](const run& pending) { count_site(sites, pending.site, pending.count); });
+         }
+      }
+
+      print_pending(sites);
+   }
+
+   static void poison([[maybe_unused]] const std::byte* bytes, [[maybe_unused]] std::size_t size)
+   {
+#if defined(LAZY_DESTRUCT_ASAN)
+      ASAN_POISON_MEMORY_REGION(bytes, size);
+#endif
+   }
+
+   static void unpoison([[maybe_unused]] const std::byte* bytes, [[maybe_unused]] std::size_t size)
+   {
+#if defined(LAZY_DESTRUCT_ASAN)
+      ASAN_UNPOISON_MEMORY_REGION(bytes, size);
+#endif
+   }
+#endif
+};
+
+// Process-wide service that runs the destructors of segments handed to it by
+// deferred_heap::hand_off() on its own thread. The hand-off itself is a
+// lock-free push, so workers never wait for the reclaimer.
+class deferred_reclaimer
+{
+public:
+   static deferred_reclaimer& get()
+   {
+      static deferred_reclaimer reclaimer;
+      return reclaimer;
+   }
+
+   // Starts the reclaimer thread. poll_interval bounds how long a hand-off can
+   // wait unnoticed, since pushes do not take the mutex the thread sleeps on.
+   void start(std::chrono::microseconds poll_interval = std::chrono::milliseconds{ 1 })
+   {
+      std::lock_guard lock{ control };
+      if (worker.joinable())
+      {
+         return;
+      }
+
+      stopping = false;
+      worker = std::thread{ [this, poll_interval] { run(poll_interval); } };
+      active.store(true, std::memory_order_release);
+   }
+
+   // Stops the thread after it has destroyed everything handed to it so far.
+   void stop()
+   {
+      std::lock_guard lock{ control };
+      if (!worker.joinable())
+      {
+         return;
+      }
+
+      active.store(false, std::memory_order_release);
+      {
+         std::lock_guard sleep_lock{ mutex };
+         stopping = true;
+      }
+      wake.notify_one();
+      worker.join();
+
+      drain();
+   }
+
+   bool running() const { return active.load(std::memory_order_acquire); }
+
+   // Moves the element into a segment of its own for the reclaimer thread to
+   // destroy. Returns false, leaving the element alone, when no thread runs.
+   LAZY_DESTRUCT_SITE bool post(deferred_heap::element_information info, std::byte* element)
+   {
+      if (!running())
+      {
+         return false;
+      }
+
+      deferred_heap::resolve(info);
+#if defined(LAZY_DESTRUCT_DEBUG)
+      deferred_heap::check_deferral(info, element, 1, LAZY_DESTRUCT_RETURN_ADDRESS());
+#endif
+      auto posted = std::make_unique<deferred_heap::segment>(deferred_heap::segment::capacity_for(info), std::pmr::new_delete_resource());
+      posted->push(info, element);
+      push(std::move(posted));
+#if defined(LAZY_DESTRUCT_DEBUG)
+      deferred_heap::fill_deferred(element, info.size);
+#endif
+
+      return true;
+   }
+
+   // Lets callers pin the thread to a core or lower its scheduling priority.
+   std::thread::native_handle_type native_handle() { return worker.native_handle(); }
+
+   ~deferred_reclaimer()
+   {
+      stop();
+      drain();
+   }
+
+private:
+   friend class deferred_heap;
+
+   deferred_reclaimer() = default;
+
+   void push(std::unique_ptr<deferred_heap::segment> chain)
+   {
+      inbox.push(std::move(chain));
+
+      if (sleeping.load(std::memory_order_relaxed))
+      {
+         wake.notify_one();
+      }
+   }
+
+   void run(std::chrono::microseconds poll_interval)
+   {
+      while (true)
+      {
+         drain();
+
+         std::unique_lock lock{ mutex };
+         if (stopping)
+         {
+            return;
+         }
+
+         sleeping.store(true, std::memory_order_relaxed);
+         wake.wait_for(lock, poll_interval, [this] { return stopping || !inbox.empty(); });
+         sleeping.store(false, std::memory_order_relaxed);
+      }
+   }
+
+   void drain()
+   {
+      for (auto& chain : inbox.take())
+      {
+         for (auto segment = std::move(chain); segment; segment = std::move(segment->next))
+         {
+            while (segment->pop(deferred_heap::unlimited, deferred_heap::unlimited).elements != 0);
+         }
+      }
+   }
+
+   deferred_heap::segment_stack inbox;
+
+   std::mutex control;
+   std::thread worker;
+   std::atomic<bool> active{ false };
+
+   std::mutex mutex;
+   std::condition_variable wake;
+   std::atomic<bool> sleeping{ false };
+   bool stopping = false;
+};
+
+inline bool deferred_heap::hand_off()
+{
+   if (empty())
+   {
+      return deferred_reclaimer::get().running();
+   }
+
+   if (!transfer(false))
+   {
+      return false;
+   }
+
+   first = std::make_unique<segment>(settings.capacity, settings.resource);
+   last = first.get();
+   capacity = settings.capacity;
+
+   return true;
+}
+
+inline deferred_heap::released deferred_heap::release_expensive(std::size_t limit, std::size_t bytes)
+{
+   if (settings.hand_off_expensive && !expensive.empty() && deferred_reclaimer::get().running())
+   {
+      std::size_t handed = 0;
+      std::size_t handed_elements = 0;
+      for (auto* lane = expensive.first.get(); lane; lane = lane->next.get())
+      {
+         lane->for_each_run([&](const run& pending)
+         {
+            handed += pending.count * pending.size;
+            handed_elements += pending.count;
+         });
+      }
+      note_pending(pending_bytes - std::min(handed, pending_bytes), pending_elements - std::min(handed_elements, pending_elements));
+
+      deferred_reclaimer::get().push(std::move(expensive.first));
+      return {};
+   }
+
+   return expensive.pop(limit, bytes);
+}
+
+inline bool deferred_heap::transfer(bool exiting)
+{
+   auto& reclaimer = deferred_reclaimer::get();
+   if (!reclaimer.running() || pinned != 0 || draining)
+   {
+      return false;
+   }
+
+   if (exiting)
+   {
+      release_posted(0, 0);
+   }
+
+   for (auto* pool = pools; pool; pool = pool->next)
+   {
+      if (pool->pending != 0)
+      {
+         spilled.append(pool->flush(*pool));
+      }
+   }
+
+   for (auto* chain : { &first, &spilled.first, &unplaced.first, &expensive.first, &posted.first })
+   {
+      if (*chain && (exiting || chain != &posted.first))
+      {
+         reclaimer.push(std::move(*chain));
+      }
+   }
+
+   last = nullptr;
+   capacity = 0;
+   note_pending(0, 0);
+
+   return true;
+}
+
+// Per-thread store for retired objects of one type, kept apart from the heap's
+// arena in fixed-stride slots: entries need no header, and the deleter is the
+// type's destructor, so a drain destroys a contiguous range in one loop. The
+// pool holds as many objects as fit in options::capacity and passes the rest
+// to the heap. It is visited by the drains of the thread's own heap, which
+// keep the pool's elements in order relative to each other but not to the
+// heap's own entries.
+template<typename type>
+class deferred_pool : private deferred_heap::pool_link
+{
+public:
+   static deferred_pool& get()
+   {
+      thread_local deferred_pool pool{ deferred_heap::thread_heap() };
+      return pool;
+   }
+
+   deferred_pool(const deferred_pool&) = delete;
+   deferred_pool& operator=(const deferred_pool&) = delete;
+
+   // Whether get() may be called on this thread. At thread exit the pool is
+   // destroyed before the heap, and one first needed while the heap is being
+   // destroyed would outlive it, so elements then go to the heap instead.
+   static bool available()
+   {
+      return state() == lifetime::alive || (state() == lifetime::unused && !deferred_heap::exiting());
+   }
+
+   // Moves the object at element into the pool, leaving its storage free.
+   // Inside a deferred_scope the object goes to the scope's heap instead.
+   LAZY_DESTRUCT_SITE void enqueue(type* element)
+   {
+#if defined(LAZY_DESTRUCT_DEBUG)
+      auto info = deferred_heap::element_information::of<type>();
+      deferred_heap::check_deferral(info, reinterpret_cast<std::byte*>(element), 1, LAZY_DESTRUCT_RETURN_ADDRESS());
+      const deferred_heap::debug_site site{ info.site };
+#endif
+
+      if (auto* scoped = deferred_heap::current_scope(); scoped || pending == capacity)
+      {
+         (scoped ? *scoped : heap).enqueue(deferred_heap::element_information::of<type>(), reinterpret_cast<std::byte*>(element));
+         return;
+      }
+
+      heap.relieve_if_pressed();
+      heap.note_enqueued(sizeof(type));
+
+      auto* slot = storage + (head + pending) % capacity * sizeof(type);
+#if defined(LAZY_DESTRUCT_DEBUG)
+      deferred_heap::unpoison(slot, sizeof(type));
+      sites[(head + pending) % capacity] = info.site;
+#endif
+      if constexpr(trivially_relocatable_v<type>)
+      {
+         std::memcpy(slot, element, sizeof(type));
+      }
+      else
+      {
+         new (slot) type(std::move(*element));
+         std::destroy_at(element);
+      }
+
+      ++pending;
+#if defined(LAZY_DESTRUCT_DEBUG)
+      deferred_heap::fill_deferred(reinterpret_cast<std::byte*>(element), sizeof(type));
+#endif
+   }
+
+   std::size_t size() const { return pending; }
+
+private:
+   explicit deferred_pool(deferred_heap& heap)
+      :
+      pool_link{ &release, &flush },
+      heap{ heap },
+      capacity{ std::max<std::size_t>(heap.settings.capacity / sizeof(type), 1UL) },
+      storage{ static_cast<std::byte*>(heap.settings.resource->allocate(capacity * sizeof(type), alignof(type))) }
+   {
+#if defined(LAZY_DESTRUCT_DEBUG)
+      deferred_heap::poison(storage, capacity * sizeof(type));
+#endif
+      heap.attach(*this);
+      state() = lifetime::alive;
+   }
+
+   // Thread-local pools are destroyed before the heap they attach to, which
+   // get() creates first.
+   ~deferred_pool()
+   {
+      state() = lifetime::destroyed;
+      heap.detach(*this);
+
+      if (pending != 0 && heap.settings.on_exit == deferred_heap::exit_policy::hand_off)
+      {
+         heap.spilled.append(flush(*this));
+      }
+      else
+      {
+#if defined(LAZY_DESTRUCT_DEBUG)
+         deferred_heap::site_counts pending_sites;
+         for (std::size_t index = 0; index < pending; ++index)
+         {
+            deferred_heap::count_site(pending_sites, sites[(head + index) % capacity], 1);
+         }
+         deferred_heap::print_pending(pending_sites);
+#endif
+
+         const deferred_heap::drain_scope scope{ heap };
+         while (true)
+         {
+            const auto batch = release(*this, deferred_heap::unlimited, deferred_heap::unlimited);
+            if (batch.elements == 0)
+            {
+               break;
+            }
+
+            heap.note_released(batch, true);
+         }
+      }
+
+#if defined(LAZY_DESTRUCT_DEBUG)
+      deferred_heap::unpoison(storage, capacity * sizeof(type));
+#endif
+      heap.settings.resource->deallocate(storage, capacity * sizeof(type), alignof(type));
+   }
+
+   type* at(std::size_t index)
+   {
+      return std::launder(reinterpret_cast<type*>(storage + index * sizeof(type)));
+   }
+
+   // Destroys the oldest elements up to the end of the slot array. Objects
+   // enqueued by their destructors land behind the pending ones, so they never
+   // reuse a slot that is still being destroyed.
+   static deferred_heap::released release(pool_link& link, std::size_t limit, std::size_t bytes)
+   {
+      auto& pool = static_cast<deferred_pool&>(link);
+      const auto count = std::min({
+         limit,
+         pool.pending,
+         pool.capacity - pool.head,
+         bytes / sizeof(type) + (bytes % sizeof(type) != 0) });
+
+      std::destroy_n(pool.at(pool.head), count);
+#if defined(LAZY_DESTRUCT_DEBUG)
+      deferred_heap::poison(pool.storage + pool.head * sizeof(type), count * sizeof(type));
+#endif
+
+      pool.head = (pool.head + count) % pool.capacity;
+      pool.pending -= count;
+
+      return { count, count * sizeof(type), deferred_heap::element_information::of<type>().deleter };
+   }
+
+   static std::unique_ptr<deferred_heap::segment> flush(pool_link& link)
+   {
+      auto& pool = static_cast<deferred_pool&>(link);
+      auto info = deferred_heap::element_information::of<type>();
+
+#if defined(LAZY_DESTRUCT_DEBUG)
+      // Elements deferred from different sites do not share a run.
+      const auto size = deferred_heap::segment::capacity_for(info) * pool.pending;
+#else
+      const auto size = deferred_heap::segment::capacity_for(info, pool.pending);
+#endif
+      auto moved = std::make_unique<deferred_heap::segment>(size, pool.heap.settings.resource);
+      for (; pool.pending != 0; --pool.pending)
+      {
+#if defined(LAZY_DESTRUCT_DEBUG)
+         info.site = pool.sites[pool.head];
+#endif
+         moved->push(info, reinterpret_cast<std::byte*>(pool.at(pool.head)));
+         pool.head = (pool.head + 1) % pool.capacity;
+      }
+
+      return moved;
+   }
+
+   enum class lifetime
+   {
+      unused,
+      alive,
+      destroyed,
+   };
+
+   static lifetime& state()
+   {
+      thread_local lifetime current = lifetime::unused;
+      return current;
+   }
+
+   deferred_heap& heap;
+   std::size_t capacity;
+   std::byte* storage;
+   std::size_t head = 0;
+#if defined(LAZY_DESTRUCT_DEBUG)
+   // Where the object in each slot was deferred from.
+   std::vector<const void*> sites = std::vector<const void*>(capacity);
+#endif
+};
+
+// Sends the calling thread's deferred destruction to a heap of its own for the
+// scope's lifetime, e.g. one request, so that the region is released in bulk
+// when the scope ends: drained there or, with exit_policy::hand_off, passed to
+// the running reclaimer. Scopes nest, the innermost one receiving the objects,
+// and must end on the thread that opened them. Objects destroyed while the
+// scope's heap drains go to the enclosing heap.
+class deferred_scope
+{
+public:
+   // Uses the options the thread's own heap was, or will be, configured with.
+   deferred_scope()
+      :
+      deferred_scope{ deferred_heap::thread_configuration().settings }
+   {}
+
+   explicit deferred_scope(const deferred_heap::options& settings)
+      :
+      owned{ settings },
+      previous{ std::exchange(deferred_heap::current_scope(), &owned) }
+   {}
+
+   deferred_scope(const deferred_scope&) = delete;
+   deferred_scope& operator=(const deferred_scope&) = delete;
+
+   ~deferred_scope()
+   {
+      deferred_heap::current_scope() = previous;
+   }
+
+   deferred_heap& heap() { return owned; }
+
+private:
+   deferred_heap owned;
+   deferred_heap* previous;
+};
+
+// Drains the calling thread's heap in short slices while the thread would
+// otherwise be idle, so that no explicit clear() calls are needed.
+class idle_drainer
+{
+public:
+   explicit idle_drainer(std::chrono::nanoseconds budget = std::chrono::microseconds{ 100 })
+      :
+      budget{ budget }
+   {}
+
+   // Drains for about the budget and returns whether another slice could
+   // destroy more: false once the heap is empty or the slice destroyed
+   // nothing, e.g. because an object created by emplace() is still alive.
+   bool on_idle() const
+   {
+      auto& heap = deferred_heap::get();
+      if (heap.empty())
+      {
+         return false;
+      }
+
+      return heap.drain_for(budget) != 0 && !heap.empty();
+   }
+
+   // For event loops: pass the timeout the loop is about to block with, e.g.
+   // in epoll_wait() or io_uring_wait_cqe_timeout(), and wait with the result.
+   // While draining makes progress it is zero, so the loop polls and comes
+   // back.
+   template<typename rep, typename period>
+   std::chrono::duration<rep, period> before_wait(std::chrono::duration<rep, period> timeout) const
+   {
+      return on_idle() ? std::chrono::duration<rep, period>::zero() : timeout;
+   }
+
+   // The same for timeouts in milliseconds, as taken by epoll_wait() and
+   // poll(), where -1 waits forever.
+   int before_wait(int timeout) const
+   {
+      return on_idle() ? 0 : timeout;
+   }
+
+private:
+   std::chrono::nanoseconds budget;
+};
+
+#if defined(LAZY_DESTRUCT_COROUTINES)
+template<drain_executor executor>
+class drain_awaitable
+{
+public:
+   drain_awaitable(deferred_heap& heap, executor& scheduler, std::size_t batch_size)
+      :
+      heap{ heap },
+      scheduler{ scheduler },
+      batch_size{ std::max(batch_size, std::size_t{ 1 }) }
+   {}
+
+   bool await_ready() const { return heap.empty(); }
+
+   // Runs the first batch right away and only suspends if more are left.
+   bool await_suspend(std::coroutine_handle<> coroutine)
+   {
+      awaiting = coroutine;
+      return !drain_batch();
+   }
+
+   std::size_t await_resume() const { return drained; }
+
+private:
+   // Returns true once the heap is empty or a batch destroyed nothing, as
+   // when an object created by emplace() is alive; otherwise queues the next
+   // batch.
+   bool drain_batch()
+   {
+      const auto batch = heap.drain_n(batch_size);
+      drained += batch;
+      if (batch == 0 || heap.empty())
+      {
+         return true;
+      }
+
+      scheduler.execute([this]
+      {
+         if (drain_batch())
+         {
+            awaiting.resume();
+         }
+      });
+      return false;
+   }
+
+   deferred_heap& heap;
+   executor& scheduler;
+   std::size_t batch_size;
+   std::size_t drained = 0;
+   std::coroutine_handle<> awaiting;
+};
+
+template<drain_executor executor>
+drain_awaitable<executor> deferred_heap::drain_async(executor& scheduler, std::size_t batch_size)
+{
+   return { *this, scheduler, batch_size };
+}
+#endif
+
+// Adapts a thread pool's executor, anything with execute(task), so that a
+// worker finishing a task submitted through the adapter drains its own heap
+// for a budget, before it goes looking for more work, when no such task is
+// waiting to start: the pool's queue has run dry. Tasks that are still
+// running on other workers do not hold the drain back.
+template<typename executor>
+class idle_draining_executor
+{
+public:
+   explicit idle_draining_executor(executor& inner, std::chrono::nanoseconds budget = std::chrono::microseconds{ 100 })
+      :
+      inner{ &inner },
+      drainer{ budget }
+   {}
+
+   template<typename task>
+   void execute(task&& work)
+   {
+      waiting->fetch_add(1, std::memory_order_relaxed);
+      inner->execute([waiting = waiting, drainer = drainer, work = std::forward<task>(work)]() mutable
+      {
+         waiting->fetch_sub(1, std::memory_order_relaxed);
+         const finished done{ *waiting, drainer };
+         work();
+      });
+   }
+
+private:
+   class finished
+   {
+   public:
+      finished(const std::atomic<std::size_t>& waiting, const idle_drainer& drainer)
+         :
+         waiting{ waiting },
+         drainer{ drainer }
+      {}
+
+      finished(const finished&) = delete;
+      finished& operator=(const finished&) = delete;
+
+      ~finished()
+      {
+         if (waiting.load(std::memory_order_relaxed) == 0)
+         {
+            drainer.on_idle();
+         }
+      }
+
+   private:
+      const std::atomic<std::size_t>& waiting;
+      const idle_drainer& drainer;
+   };
+
+   executor* inner;
+   idle_drainer drainer;
+   // Tasks submitted but not yet started, shared with the submitted tasks,
+   // which may outlive the adapter.
+   std::shared_ptr<std::atomic<std::size_t>> waiting = std::make_shared<std::atomic<std::size_t>>(0);
+};
+
+// Collects the drain spans of every thread as Chrome trace events, which
+// chrome://tracing and Perfetto load, so that destructor work can be lined up
+// with request latency. Event times are steady_clock microseconds.
+class drain_trace
+{
+public:
+   static drain_trace& get()
+   {
+      static drain_trace trace;
+      return trace;
+   }
+
+   void start() { deferred_heap::trace_drains(&record); }
+   void stop() { deferred_heap::trace_drains(nullptr); }
+
+   // Writes the spans recorded so far as a JSON trace and forgets them.
+   void write(std::ostream& out)
+   {
+      std::vector<deferred_heap::drain_span> taken;
+      {
+         std::lock_guard lock{ mutex };
+         taken.swap(spans);
+      }
+
+      const auto flags = out.flags();
+      const auto precision = out.precision();
+      out.setf(std::ios::fixed, std::ios::floatfield);
+      out.precision(3);
+
+      const auto microseconds = [](auto duration)
+      {
+         return std::chrono::duration<double, std::micro>(duration).count();
+      };
+
+      out << "{\"traceEvents\":[";
+      const char* separator = "";
+      for (const auto& span : taken)
+      {
+         out << separator
+            << "{\"name\":\"drain\",\"cat\":\"lazy_destruct\",\"ph\":\"X\",\"pid\":1"
+            << ",\"tid\":" << static_cast<std::uint32_t>(std::hash<std::thread::id>{}(span.thread))
+            << ",\"ts\":" << microseconds(span.start.time_since_epoch())
+            << ",\"dur\":" << microseconds(span.duration)
+            << ",\"args\":{\"elements\":" << span.elements << ",\"bytes\":" << span.bytes << "}}";
+         separator = ",";
+      }
+      out << "]}";
+
+      out.flags(flags);
+      out.precision(precision);
+   }
+
+private:
+   drain_trace() = default;
+
+   static void record(const deferred_heap::drain_span& span)
+   {
+      auto& trace = get();
+
+      std::lock_guard lock{ trace.mutex };
+      trace.spans.push_back(span);
+   }
+
+   std::mutex mutex;
+   std::vector<deferred_heap::drain_span> spans;
+};
+
+template<typename executor>
+void deferred_heap::clear(executor& workers, std::size_t helpers, std::size_t chunk_size)
+{
+   if (pinned != 0 || helpers == 0 || chunk_size == 0)
+   {
+      clear();
+      return;
+   }
+
+   const drain_scope scope{ *this };
+   release_posted(0, 0);
+
+   // Everything pending is detached first, so that objects deferred while the
+   // destructors run land in fresh storage and are cleared afterwards.
+   std::unique_ptr<segment> chains[] = {
+      std::exchange(first, std::make_unique<segment>(settings.capacity, settings.resource)),
+      std::move(spilled.first),
+      std::move(unplaced.first),
+      std::move(expensive.first),
+      std::move(posted.first) };
+   last = first.get();
+   capacity = settings.capacity;
+
+   std::vector<run> serial;
+   std::vector<run> chunks;
+   for (auto& chain : chains)
+   {
+      for (auto* detached = chain.get(); detached; detached = detached->next.get())
+      {
+         detached->for_each_run([&](const run& pending)
+         {
+            note_released({ pending.count, pending.count * pending.size, pending.deleter }, &chain != &chains[4]);
+
+            if (!pending.thread_agnostic)
+            {
+               serial.push_back(pending);
+               return;
+            }
+
+            for (std::size_t done = 0; done < pending.count; done += chunk_size)
+            {
+               chunks.push_back({ pending.deleter, pending.objects + done * pending.size, std::min(chunk_size, pending.count - done), pending.size, true });
+            }
+         });
+      }
+   }
+
+   std::shared_ptr<parallel_drain> shared;
+   if (!chunks.empty())
+   {
+      helpers = std::min(helpers, std::size(chunks) - 1);
+      shared = std::make_shared<parallel_drain>(std::move(chunks), helpers + 1);
+
+      for (std::size_t helper = 1; helper <= helpers; ++helper)
+      {
+         workers.execute([shared, helper] { shared->work(helper); });
+      }
+   }
+
+   for (const auto& pending : serial)
+   {
+      pending.deleter(pending.objects, pending.count);
+   }
+
+   if (shared)
+   {
+      shared->work(0);
+      shared->wait();
+   }
+
+   // The detached segments only release their storage.
+   for (auto& chain : chains)
+   {
+      while (chain)
+      {
+         chain = std::move(chain->next);
+      }
+   }
+
+   clear();
+}
+
+template<typename type, destruction_cost cost = lazy_destruct_cost_v<type>>
+class lazy_destruct
+{
+public:
+   using element_type = type;
+   using reference = element_type&;
+   using const_reference = const element_type&;
+   using pointer = element_type*;
+   using const_pointer = const element_type*;
+
+   template<typename...Args>
+   lazy_destruct(Args&&... args)
+   {
+#if defined(LAZY_DESTRUCT_DEBUG)
+      // Bytes the constructor leaves unset must not keep the fill pattern of
+      // an object deferred from the same storage before.
+      std::memset(value, 0, sizeof(value));
+#endif
+      new (value) element_type{ std::forward < Args &&> (args)...};
+   }
+
+   lazy_destruct(lazy_destruct&& other)
+   {
+#if defined(LAZY_DESTRUCT_DEBUG)
+      std::memset(value, 0, sizeof(value));
+#endif
+      new (value) element_type(std::move(*other));
+   }
+
+   LAZY_DESTRUCT_SITE ~lazy_destruct()
+   {
+#if defined(LAZY_DESTRUCT_DEBUG)
+      const deferred_heap::debug_site site{ LAZY_DESTRUCT_RETURN_ADDRESS() };
+#endif
+      retire(operator->());
+   }
+
+   // Destroys or defers the object at object as ~lazy_destruct() does. Either
+   // way its lifetime ends and its storage may be reused right away.
+   static void retire(pointer object)
+   {
+      constexpr auto policy = lazy_destruct_policy_v<element_type>;
+      auto* bytes = reinterpret_cast<std::byte*>(object);
+
+      if constexpr(std::is_trivially_destructible_v<element_type>)
+      {
+         return;
+      }
+      else if constexpr(policy == destruction_policy::immediate)
+      {
+         std::destroy_at(object);
+      }
+      else if constexpr(!trivially_relocatable_v<element_type> && !std::is_nothrow_move_constructible_v<element_type>)
+      {
+         // Relocating into the heap could throw, so destroy in place instead.
+         std::destroy_at(object);
+      }
+      else if constexpr(cost == destruction_cost::expensive && policy != destruction_policy::background)
+      {
+         deferred_heap::get().enqueue_expensive(deferred_heap::element_information::of<element_type>(), bytes);
+      }
+      else if constexpr(policy == destruction_policy::batched)
+      {
+         if (deferred_pool<element_type>::available())
+         {
+            deferred_pool<element_type>::get().enqueue(object);
+         }
+         else
+         {
+            deferred_heap::get().enqueue(deferred_heap::element_information::of<element_type>(), bytes);
+         }
+      }
+      else
+      {
+         const auto info = deferred_heap::element_information::of<element_type>();
+         if (policy == destruction_policy::deferred || !deferred_reclaimer::get().post(info, bytes))
+         {
+            deferred_heap::get().enqueue(info, bytes);
+         }
+      }
+   }
+
+   reference operator *() { return *reinterpret_cast<element_type*>(value); }
+   const_reference operator *() const { return * reinterpret_cast<const element_type*>(value); }
+   pointer operator->() { return reinterpret_cast<element_type*>(value); }
+   const_pointer operator->() const { return reinterpret_cast<const element_type*>(value); }
+
+private:
+   alignas(element_type) std::byte value[sizeof(element_type)];
+};
+
+// Defers the destruction of value, which is moved into the heap. For a
+// container that moves only its handle, so the buffer changes hands without
+// its elements being touched. Lvalues and const objects, which would be
+// copied, are rejected.
+template<typename type>
+LAZY_DESTRUCT_SITE void defer(type&& value)
+{
+   static_assert(!std::is_lvalue_reference_v<type> && !std::is_const_v<type>, "defer() takes ownership; pass std::move(value) of a non-const object");
+
+   using element_type = std::remove_cv_t<std::remove_reference_t<type>>;
+#if defined(LAZY_DESTRUCT_DEBUG)
+   const deferred_heap::debug_site site{ LAZY_DESTRUCT_RETURN_ADDRESS() };
+#endif
+
+   alignas(element_type) std::byte storage[sizeof(element_type)];
+#if defined(LAZY_DESTRUCT_DEBUG)
+   std::memset(storage, 0, sizeof(storage));
+#endif
+   lazy_destruct<element_type>::retire(new (storage) element_type(std::forward<type>(value)));
+}
+
+// Defers the destruction of the objects in [first, last), which are
+// relocated into the heap as one run and later destroyed with a single
+// std::destroy_n(). Their lifetimes end here, so the caller must not destroy
+// them again. The policy and cost of type apply as for lazy_destruct, except
+// that batched types are deferred as a run too; expensive and background
+// elements are enqueued one by one.
+template<typename type, destruction_cost cost = lazy_destruct_cost_v<type>>
+LAZY_DESTRUCT_SITE void defer_range(type* first, type* last)
+{
+   constexpr auto policy = lazy_destruct_policy_v<type>;
+
+   if constexpr(std::is_trivially_destructible_v<type>)
+   {
+      return;
+   }
+   else if constexpr(policy == destruction_policy::immediate)
+   {
+      std::destroy(first, last);
+   }
+   else if constexpr(!trivially_relocatable_v<type> && !std::is_nothrow_move_constructible_v<type>)
+   {
+      std::destroy(first, last);
+   }
+   else
+   {
+#if defined(LAZY_DESTRUCT_DEBUG)
+      const deferred_heap::debug_site site{ LAZY_DESTRUCT_RETURN_ADDRESS() };
+#endif
+      const auto info = deferred_heap::element_information::of<type>();
+
+      if constexpr(cost == destruction_cost::expensive && policy != destruction_policy::background)
+      {
+         for (; first != last; ++first)
+         {
+            deferred_heap::get().enqueue_expensive(info, reinterpret_cast<std::byte*>(first));
+         }
+         return;
+      }
+      else if constexpr(policy == destruction_policy::background)
+      {
+         for (; first != last && deferred_reclaimer::get().post(info, reinterpret_cast<std::byte*>(first)); ++first);
+      }
+
+      if (first != last)
+      {
+         deferred_heap::get().enqueue_n(info, reinterpret_cast<std::byte*>(first), static_cast<std::size_t>(last - first));
+      }
+   }
+}
+
+// A fixed array whose elements are deferred together, as one run, when it is
+// destroyed.
+template<typename type, std::size_t count, destruction_cost cost = lazy_destruct_cost_v<type>>
+class lazy_destruct_array
 {
 public:
-   struct element_information
+   using element_type = type;
+   using reference = element_type&;
+   using const_reference = const element_type&;
+   using pointer = element_type*;
+   using const_pointer = const element_type*;
+
+   // Constructs every element from the same arguments.
+   template<typename... Args>
+   lazy_destruct_array(const Args&... args)
    {
-      element_information(
-         std::size_t size,
-         void (*deleter)(std::byte*) noexcept)
-         :
-         size{ size },
-         deleter{ deleter }
-      {}
+#if defined(LAZY_DESTRUCT_DEBUG)
+      std::memset(value, 0, sizeof(value));
+#endif
+      std::size_t constructed = 0;
+      try
+      {
+         for (; constructed < count; ++constructed)
+         {
+            new (value + constructed * sizeof(element_type)) element_type{ args... };
+         }
+      }
+      catch (...)
+      {
+         std::destroy_n(data(), constructed);
+         throw;
+      }
+   }
 
-      std::size_t size;
-      void (*deleter)(std::byte*) noexcept;
+   lazy_destruct_array(const lazy_destruct_array&) = delete;
+   lazy_destruct_array& operator=(const lazy_destruct_array&) = delete;
 
-      std::size_t offset;
-   };
+   LAZY_DESTRUCT_SITE ~lazy_destruct_array()
+   {
+#if defined(LAZY_DESTRUCT_DEBUG)
+      const deferred_heap::debug_site site{ LAZY_DESTRUCT_RETURN_ADDRESS() };
+#endif
+      defer_range<element_type, cost>(data(), data() + count);
+   }
 
-   static deferred_heap& get()
+   reference operator[](std::size_t index) { return data()[index]; }
+   const_reference operator[](std::size_t index) const { return data()[index]; }
+
+   pointer data() { return std::launder(reinterpret_cast<element_type*>(value)); }
+   const_pointer data() const { return std::launder(reinterpret_cast<const element_type*>(value)); }
+
+   pointer begin() { return data(); }
+   pointer end() { return data() + count; }
+   const_pointer begin() const { return data(); }
+   const_pointer end() const { return data() + count; }
+
+   static constexpr std::size_t size() { return count; }
+
+private:
+   alignas(element_type) std::byte value[sizeof(element_type) * count];
+};
+
+// Holds deferred_delete's wrapped deleter, taking no space when it is empty.
+template<typename deleter, bool = std::is_empty_v<deleter> && !std::is_final_v<deleter>>
+class deferred_delete_base
+{
+public:
+   deferred_delete_base() = default;
+   deferred_delete_base(deleter inner) : inner{ std::move(inner) } {}
+
+   const deleter& get_deleter() const { return inner; }
+
+private:
+   deleter inner;
+};
+
+template<typename deleter>
+class deferred_delete_base<deleter, true> : private deleter
+{
+public:
+   deferred_delete_base() = default;
+   deferred_delete_base(deleter inner) : deleter{ std::move(inner) } {}
+
+   const deleter& get_deleter() const { return *this; }
+};
+
+template<typename type, typename = void>
+struct has_unsized_class_delete : std::false_type {};
+
+template<typename type>
+struct has_unsized_class_delete<type, std::void_t<decltype(type::operator delete(static_cast<void*>(nullptr)))>> : std::true_type {};
+
+template<typename type, typename = void>
+struct has_sized_class_delete : std::false_type {};
+
+template<typename type>
+struct has_sized_class_delete<type, std::void_t<decltype(type::operator delete(static_cast<void*>(nullptr), std::size_t{}))>> : std::true_type {};
+
+// Whether sized_delete can free a pointer to type on behalf of delete: the
+// block must come from the global operator new and have exactly sizeof(type)
+// bytes, which rules out arrays, class-specific allocation functions and
+// deletion through a base class.
+template<typename type>
+inline constexpr bool sized_deletable_v =
+   !std::is_array_v<type>
+   && (!std::has_virtual_destructor_v<type> || std::is_final_v<type>)
+   && !has_unsized_class_delete<type>::value
+   && !has_sized_class_delete<type>::value;
+
+// Replacement for std::default_delete that destroys the object but leaves
+// the memory to the running drain's options::batch_free when there is one.
+template<typename type>
+struct sized_delete
+{
+   sized_delete() = default;
+   sized_delete(std::default_delete<type>) {}
+
+   void operator()(type* object) const noexcept
    {
-      thread_local deferred_heap heap;
-      return heap;
+      std::destroy_at(object);
+      if (!deferred_heap::defer_free(object, sizeof(type), alignof(type)))
+      {
+         deferred_heap::deallocate(object, sizeof(type), alignof(type));
+      }
    }
+};
+
+// Deleter that hands a pointer, together with the deleter that would have
+// released it, to the calling thread's deferred_heap instead of deleting it.
+// The whole object graph behind the pointer is then torn down by a later
+// drain, whatever its size. Works with std::unique_ptr and as the deleter of
+// a std::shared_ptr.
+template<typename type, typename deleter = std::default_delete<type>>
+class deferred_delete : public deferred_delete_base<deleter>
+{
+public:
+   using owner_type = std::unique_ptr<type, deleter>;
+   using pointer = typename owner_type::pointer;
+
+   deferred_delete() = default;
+   deferred_delete(deleter inner) : deferred_delete_base<deleter>{ std::move(inner) } {}
 
-   void enqueue(element_information info, std::byte* element)
+   template<
+      typename other_type,
+      typename other_deleter,
+      typename = std::enable_if_t<
+         std::is_convertible_v<typename deferred_delete<other_type, other_deleter>::pointer, pointer>
+         && std::is_constructible_v<deleter, const other_deleter&>>>
+   deferred_delete(const deferred_delete<other_type, other_deleter>& other)
+      :
+      deferred_delete_base<deleter>{ deleter(other.get_deleter()) }
+   {}
+
+   LAZY_DESTRUCT_SITE void operator()(pointer object) const
    {
-      info.offset = elements.empty() ? 0 : elements.back().offset + elements.back().size;
+#if defined(LAZY_DESTRUCT_DEBUG)
+      const deferred_heap::debug_site site{ LAZY_DESTRUCT_RETURN_ADDRESS() };
+#endif
+      // Plain deletes are routed through sized_delete so that drains can
+      // batch the deallocations.
+      using deferred_type = std::conditional_t<
+         std::is_same_v<deleter, std::default_delete<type>> && sized_deletable_v<type>,
+         std::unique_ptr<type, sized_delete<type>>,
+         owner_type>;
 
-      if (info.offset + info.size > std::size(heap))
+      if constexpr(!trivially_relocatable_v<deferred_type> && !std::is_nothrow_move_constructible_v<deferred_type>)
       {
-         info.deleter(element);
-         return;
+         this->get_deleter()(object);
       }
+      else
+      {
+         alignas(deferred_type) std::byte owner[sizeof(deferred_type)];
+         new (owner) deferred_type{ object, this->get_deleter() };
+         deferred_heap::get().enqueue(deferred_heap::element_information::of<deferred_type>(), owner);
+      }
+   }
+};
+
+template<typename type, typename deleter = std::default_delete<type>>
+using lazy_unique_ptr = std::unique_ptr<type, deferred_delete<type, deleter>>;
+
+template<typename type, typename... Args>
+lazy_unique_ptr<type> make_lazy_unique(Args&&... args)
+{
+   return lazy_unique_ptr<type>{ new type(std::forward<Args>(args)...) };
+}
 
-      std::copy(element, element + info.size, std::begin(heap) + info.offset);
-      elements.emplace(std::move(info));
+// Deleter that makes sure the object is destroyed on the thread that created
+// the deleter, for objects tied to that thread's resources. Deleting on the
+// owning thread defers like deferred_delete; any other thread posts the
+// pointer to the owner's heap, which must still exist.
+template<typename type, typename deleter = std::default_delete<type>>
+class owner_delete : public deferred_delete_base<deleter>
+{
+public:
+   using owner_type = std::unique_ptr<type, deleter>;
+   using pointer = typename owner_type::pointer;
+
+   owner_delete() : owner_delete{ deleter{} } {}
+
+   owner_delete(deleter inner)
+      :
+      deferred_delete_base<deleter>{ std::move(inner) },
+      heap{ &deferred_heap::thread_heap() },
+      thread{ std::this_thread::get_id() }
+   {}
+
+   LAZY_DESTRUCT_SITE void operator()(pointer object) const
+   {
+#if defined(LAZY_DESTRUCT_DEBUG)
+      const deferred_heap::debug_site site{ LAZY_DESTRUCT_RETURN_ADDRESS() };
+#endif
+      if (std::this_thread::get_id() == thread)
+      {
+         deferred_delete<type, deleter>{ this->get_deleter() }(object);
+      }
+      else
+      {
+         heap->post(owner_type{ object, this->get_deleter() });
+      }
    }
 
-   bool dequeue()
+private:
+   deferred_heap* heap;
+   std::thread::id thread;
+};
+
+// Epoch-based reclamation for objects that other threads may still be
+// reading. Readers wrap each access in a read_guard; retire() parks an
+// unlinked object in one of the calling thread's deferred heaps, and the
+// object is destroyed only after every reader that could have seen it has
+// left its critical section. Threads may outlive the domain.
+class epoch_domain
+{
+   struct participant;
+
+public:
+   // Marks the calling thread as reading. Guards nest and are cheap: the
+   // outermost one publishes the current epoch, the rest only count.
+   class read_guard
    {
-      if (elements.empty())
+   public:
+      explicit read_guard(epoch_domain& domain) : reader{ domain.local() }
       {
-         return false;
+         if (reader.nesting++ == 0)
+         {
+            reader.epoch.store(domain.epoch.load(std::memory_order_seq_cst) << 1 | active, std::memory_order_seq_cst);
+         }
       }
 
-      const auto& head_element = elements.front();
-      head_element.deleter(heap.data() + head_element.offset);
-      elements.pop();
+      read_guard(const read_guard&) = delete;
+      read_guard& operator=(const read_guard&) = delete;
 
-      return true;
+      ~read_guard()
+      {
+         if (--reader.nesting == 0)
+         {
+            reader.epoch.store(reader.epoch.load(std::memory_order_relaxed) & ~active, std::memory_order_release);
+         }
+      }
+
+   private:
+      participant& reader;
+   };
+
+   epoch_domain() = default;
+   epoch_domain(const epoch_domain&) = delete;
+   epoch_domain& operator=(const epoch_domain&) = delete;
+
+   // Destroys everything still retired; no thread may be reading any more.
+   // Records still held by live threads are freed when those threads exit.
+   ~epoch_domain()
+   {
+      for (auto* record = participants.load(std::memory_order_acquire); record; )
+      {
+         for (auto& limbo : record->limbo)
+         {
+            limbo.heap.clear();
+         }
+
+         record->orphaned.store(true, std::memory_order_relaxed);
+         release(std::exchange(record, record->next));
+      }
    }
 
-   void clear()
+   // Defers destroying object through deleter until a grace period passes.
+   template<typename type, typename deleter = std::default_delete<type>>
+   void retire(type* object, deleter inner = {})
+   {
+      using owner_type = std::unique_ptr<type, deleter>;
+
+      auto& record = local();
+      const auto current = epoch.load(std::memory_order_seq_cst);
+      auto& limbo = record.limbo[current % std::size(record.limbo)];
+
+      // The bag last held objects retired three epochs ago, which are safe.
+      // When this is called from the destructor of such an object, the bag
+      // is already being emptied and only changes its epoch.
+      if (limbo.epoch != current)
+      {
+         expire(record, limbo);
+         limbo.epoch = current;
+      }
+
+      alignas(owner_type) std::byte owner[sizeof(owner_type)];
+      new (owner) owner_type{ object, std::move(inner) };
+      limbo.heap.enqueue(deferred_heap::element_information::of<owner_type>(), owner);
+
+      collect(record);
+   }
+
+   // Tries to end the current grace period and destroys the calling thread's
+   // objects whose grace period has passed, along with those left behind by
+   // exited threads. Returns the number of objects destroyed.
+   std::size_t collect()
    {
-      while(dequeue());
+      auto destroyed = collect(local());
+
+      for (auto* record = participants.load(std::memory_order_acquire); record; record = record->next)
+      {
+         bool expected = false;
+         if (record->in_use.compare_exchange_strong(expected, true, std::memory_order_acquire))
+         {
+            destroyed += collect(*record);
+            record->in_use.store(false, std::memory_order_release);
+         }
+      }
+
+      return destroyed;
    }
 
-   ~deferred_heap()
+   // Blocks until everything the calling thread retired has been destroyed.
+   // Must not be called from inside a read_guard.
+   void synchronize()
    {
-      clear();
+      auto& record = local();
+      while (true)
+      {
+         collect(record);
+
+         const auto pending = std::any_of(std::begin(record.limbo), std::end(record.limbo), [](const auto& limbo)
+         {
+            return !limbo.heap.empty();
+         });
+         if (!pending)
+         {
+            return;
+         }
+
+         std::this_thread::yield();
+      }
    }
 
 private:
-   deferred_heap(std::size_t capacity = 512UL) { heap.resize(capacity); }
+   static constexpr std::uint64_t active = 1;
+
+   // Per-thread state. Records are never freed before the domain; when a
+   // thread exits, its record (and any objects still in its limbo bags) is
+   // picked up by the next thread that needs one. The domain and the thread
+   // using a record each hold a reference, so whichever lets go last frees it.
+   struct participant
+   {
+      struct bag
+      {
+         deferred_heap heap;
+         std::uint64_t epoch = 0;
+      };
+
+      static deferred_heap::options limbo_options()
+      {
+         // Retired objects may never be destroyed early, so nothing is dropped
+         // inline on overflow or drained under memory pressure.
+         deferred_heap::options settings;
+         settings.policy = deferred_heap::capacity_policy::geometric;
+         settings.overflow = deferred_heap::overflow_policy::spill;
+         settings.relieve_on_pressure = false;
+         return settings;
+      }
+
+      // Observed epoch shifted left by one, with the low bit set while reading.
+      std::atomic<std::uint64_t> epoch{ 0 };
+      std::atomic<bool> in_use{ true };
+      std::atomic<std::size_t> references{ 2 };
+      // Set once the domain is gone.
+      std::atomic<bool> orphaned{ false };
+      std::size_t nesting = 0;
+      // Set while objects from the limbo bags are being destroyed.
+      bool collecting = false;
+      participant* next = nullptr;
+
+      bag limbo[3]{
+         { deferred_heap{ limbo_options() } },
+         { deferred_heap{ limbo_options() } },
+         { deferred_heap{ limbo_options() } } };
+   };
+
+   static void release(participant* record)
+   {
+      if (record->references.fetch_sub(1, std::memory_order_acq_rel) == 1)
+      {
+         delete record;
+      }
+   }
+
+   // Entries are keyed by the domain's id, which unlike its address is never
+   // reused by a later domain.
+   struct thread_records
+   {
+      std::vector<std::pair<std::uint64_t, participant*>> entries;
+
+      ~thread_records()
+      {
+         for (auto& entry : entries)
+         {
+            entry.second->in_use.store(false, std::memory_order_release);
+            release(entry.second);
+         }
+      }
+   };
+
+   participant& local()
+   {
+      thread_local thread_records records;
+
+      for (auto& entry : records.entries)
+      {
+         if (entry.first == id)
+         {
+            return *entry.second;
+         }
+      }
+
+      // Drops the records of domains that are gone before adding one.
+      auto& entries = records.entries;
+      entries.erase(std::remove_if(std::begin(entries), std::end(entries), [](const auto& entry)
+      {
+         if (!entry.second->orphaned.load(std::memory_order_relaxed))
+         {
+            return false;
+         }
+
+         release(entry.second);
+         return true;
+      }), std::end(entries));
+
+      auto* record = acquire();
+      entries.emplace_back(id, record);
+      return *record;
+   }
+
+   participant* acquire()
+   {
+      for (auto* record = participants.load(std::memory_order_acquire); record; record = record->next)
+      {
+         bool expected = false;
+         if (record->in_use.compare_exchange_strong(expected, true, std::memory_order_acquire))
+         {
+            record->references.fetch_add(1, std::memory_order_relaxed);
+            return record;
+         }
+      }
+
+      auto* record = new participant;
+      record->next = participants.load(std::memory_order_relaxed);
+      while (!participants.compare_exchange_weak(record->next, record, std::memory_order_release, std::memory_order_relaxed));
+
+      return record;
+   }
+
+   // Advances the global epoch if every reader has observed the current one.
+   void try_advance()
+   {
+      auto current = epoch.load(std::memory_order_seq_cst);
+
+      for (auto* record = participants.load(std::memory_order_acquire); record; record = record->next)
+      {
+         const auto observed = record->epoch.load(std::memory_order_seq_cst);
+         if ((observed & active) && (observed >> 1) != current)
+         {
+            return;
+         }
+      }
+
+      epoch.compare_exchange_strong(current, current + 1, std::memory_order_seq_cst);
+   }
+
+   std::size_t collect(participant& record)
+   {
+      if (record.collecting)
+      {
+         return 0;
+      }
+
+      try_advance();
+
+      const auto current = epoch.load(std::memory_order_seq_cst);
+      std::size_t destroyed = 0;
+
+      for (auto& limbo : record.limbo)
+      {
+         if (limbo.epoch + 2 <= current)
+         {
+            destroyed += expire(record, limbo);
+         }
+      }
+
+      return destroyed;
+   }
+
+   // Destroys the objects the bag holds when it is called. Objects that their
+   // destructors retire into the same bag are younger and stay behind, and
+   // nested calls, which would destroy the running drain's objects again, do
+   // nothing.
+   static std::size_t expire(participant& record, participant::bag& limbo)
+   {
+      if (record.collecting)
+      {
+         return 0;
+      }
+
+      record.collecting = true;
+      const auto destroyed = limbo.heap.drain_n(limbo.heap.pending_elements);
+      record.collecting = false;
+
+      return destroyed;
+   }
 
-   std::vector<std::byte> heap;
-   std::queue<element_information> elements;
+   std::atomic<std::uint64_t> epoch{ 0 };
+   std::atomic<participant*> participants{ nullptr };
+
+   static inline std::atomic<std::uint64_t> next_id{ 0 };
+   const std::uint64_t id = next_id.fetch_add(1, std::memory_order_relaxed);
 };
 
+// Owns an object created by deferred_heap::emplace().
 template<typename type>
-class lazy_destruct
+class deferred_handle
 {
 public:
    using element_type = type;
@@ -84,39 +3608,114 @@ public:
    using pointer = element_type*;
    using const_pointer = const element_type*;
 
-   template<typename...Args>
-   lazy_destruct(Args&&... args)
-   {
-      new (value) element_type{ std::forward < Args &&> (args)...};
-   }
+   deferred_handle(deferred_handle&& other) noexcept
+      :
+      heap{ other.heap },
+      entry{ std::exchange(other.entry, nullptr) },
+      storage{ std::move(other.storage) },
+      object{ std::exchange(other.object, nullptr) }
+   {}
 
-   lazy_destruct(lazy_destruct&& other) : value{ std::move(other.value) } {}
+   deferred_handle& operator=(deferred_handle&&) = delete;
 
-   ~lazy_destruct()
+   ~deferred_handle()
    {
-      if constexpr(std::is_trivially_destructible_v<element_type>)
+      if (!entry)
       {
          return;
       }
 
-      constexpr auto deleter = [](std::byte * object) noexcept
+      if (storage)
       {
-         reinterpret_cast<element_type*>(object)->~element_type();
-      };
-      deferred_heap::get().enqueue({ sizeof(element_type), deleter}, value);
+         deferred_heap::segment::retire(entry);
+         heap->unplaced.append(std::move(storage));
+      }
+      else
+      {
+         heap->retire(entry);
+      }
    }
 
-   reference operator *() { return *reinterpret_cast<element_type*>(value); }
-   const_reference operator *() const { return * reinterpret_cast<const element_type*>(value); }
-   pointer operator->() { return reinterpret_cast<element_type*>(value); }
-   const_pointer operator->() const { return reinterpret_cast<const element_type*>(value); }
+   reference operator *() { return *object; }
+   const_reference operator *() const { return *object; }
+   pointer operator->() { return object; }
+   const_pointer operator->() const { return object; }
+   pointer get() { return object; }
+   const_pointer get() const { return object; }
 
 private:
-   std::byte value[sizeof(element_type)];
+   friend class deferred_heap;
+
+   explicit deferred_handle(deferred_heap& heap) : heap{ &heap } {}
+
+   deferred_heap* heap;
+   void* entry = nullptr;
+   // Set when the object lives in a segment of its own instead of the arena.
+   std::unique_ptr<deferred_heap::segment> storage;
+   pointer object = nullptr;
 };
 
+template<typename type, typename... Args>
+deferred_handle<type> deferred_heap::emplace(Args&&... args)
+{
+   auto info = element_information::of<type>();
+#if defined(LAZY_DESTRUCT_DEBUG)
+   info.site = current_site() ? current_site() : LAZY_DESTRUCT_RETURN_ADDRESS();
+#endif
+   relieve_if_pressed();
+   deferred_handle<type> handle{ *this };
+
+   std::byte* slot = nullptr;
+   if (spilled.empty())
+   {
+      slot = last->emplace(info, handle.entry);
+      if (!slot && grow(info))
+      {
+         slot = last->emplace(info, handle.entry);
+      }
+   }
+
+   if (!slot)
+   {
+      handle.storage = std::make_unique<segment>(segment::capacity_for(info), settings.resource);
+      slot = handle.storage->emplace(info, handle.entry);
+   }
+
+   try
+   {
+      handle.object = new (slot) type{ std::forward<Args>(args)... };
+   }
+   catch (...)
+   {
+      if (!handle.storage)
+      {
+         segment::abandon(handle.entry);
+      }
+      handle.entry = nullptr;
+      throw;
+   }
+
+   if (!handle.storage)
+   {
+      ++pinned;
+   }
+
+   note_enqueued(info.size);
+   return handle;
+}
+
+inline void deferred_heap::retire(void* entry)
+{
+   segment::retire(entry);
+   --pinned;
+}
+
 // --------------- TESTING CODE ------------------
 
+// Define LAZY_DESTRUCT_NO_DEMO to include the header in other programs, such
+// as lazy_destruct_benchmark.cpp.
+#if !defined(LAZY_DESTRUCT_NO_DEMO)
+
 #include <iostream>
 #include <mutex>
 #include <thread>
@@ -137,8 +3736,8 @@ public:
     static std::size_t count;
 
     Noisy() : value{++count} { write("Constructor ", value); }
-    Noisy(const Noisy&) { write("Copy constructor ", value); }
-    Noisy(Noisy&&) { write("Move constructor ", value); }
+    Noisy(const Noisy& other) : value{ other.value } { write("Copy constructor ", value); }
+    Noisy(Noisy&& other) noexcept : value{ other.value } { write("Move constructor ", value); }
 
     Noisy& operator=(const Noisy&) { write("Copy assignment ", value); return *this; }
     Noisy& operator=(Noisy&&) { write("Move assignment ", value); return *this; }
@@ -153,6 +3752,54 @@ void helper()
     lazy_destruct<Noisy> temp[5];
 }
 
+// A node of a shared tree that retires its subtree when it is destroyed.
+class Node
+{
+    epoch_domain& domain;
+    std::size_t depth;
+    Node* child;
+public:
+    Node(epoch_domain& domain, std::size_t depth)
+        : domain{ domain }, depth{ depth }, child{ depth != 0 ? new Node{ domain, depth - 1 } : nullptr } {}
+
+    ~Node()
+    {
+        write("Node destructor ", depth);
+        if (child)
+        {
+            domain.retire(child);
+        }
+    }
+};
+
+void retire_tree()
+{
+    epoch_domain domain;
+    domain.retire(new Node{ domain, 3 });
+    domain.synchronize();
+}
+
+// Objects whose destructors defer a pooled type while the thread exits, after
+// the pool for that type is gone: a pooled one whose pool was created before
+// Noisy's, and one still pending in the heap.
+struct Parent
+{
+    ~Parent() { lazy_destruct<Noisy> child; }
+};
+
+struct Bulky
+{
+    char padding[64];
+    ~Bulky() { lazy_destruct<Noisy> child; }
+};
+
+void exit_with_pending()
+{
+    lazy_destruct<Bulky> bulky;
+    lazy_destruct<Noisy> noisy;
+    lazy_destruct<Parent> parent;
+}
+
 int main()
 {
     std::thread split_one(helper);
@@ -160,4 +3807,11 @@ int main()
 
     deferred_heap::get().clear();
     split_one.join();
+
+    retire_tree();
+
+    std::thread exiting(exit_with_pending);
+    exiting.join();
 }
+
+#endif